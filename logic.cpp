@@ -1,435 +1,2173 @@
 #include "logic.h"
 #include <sstream>
+#include <deque>
+#include <algorithm>
+#include <iterator>
+#include <bitset>
+#include <exception>
 
 namespace logic {
   
   bool ValPtrEqual::operator()(const logic::ValPtr& v1, const logic::ValPtr& v2) const {
-    return *v1 == *v2;
+    return v1 == v2;
   }
 
   std::size_t ValPtrHash::operator()(logic::ValPtr const& v) const {
     return v->hash();
   }
 
+  const std::size_t SYM_SEED = 85831957;
+  const std::size_t WILDCARD_SEED = 12952153;
+  const std::size_t REF_SEED = 128582195;
+  const std::size_t BOUND_REF_SEED = 73856093;
+  const std::size_t ARBITRARY_SEED = 95318557;
+  const std::size_t ARBITRARY_INSTANCE_SEED = 998439321;
+  const std::size_t LAMBDA_SEED = 195218521;
+  const std::size_t APPLY_SEED = 9858124;
+  const std::size_t DECLARE_SEED = 2958125;
+  const std::size_t CONSTRAIN_SEED = 28148592;
+
+  std::size_t hashMix(std::size_t seed, std::size_t v) {
+    std::uint64_t x = seed ^ (v + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+  }
+
+  std::size_t valSetHash(const ValSet& vs) {
+    std::size_t h = 0;
+    for (const ValPtr& v : vs) {
+      h += v->hash();
+    }
+    return h;
+  }
+
+  struct SymTable {
+    std::mutex lock;
+    std::unordered_map<std::string, SymId> ids;
+    std::deque<std::string> names;
+    SymTable() {
+      this->ids[""] = NULL_SYM;
+      this->names.push_back("");
+    }
+  };
+
+  SymTable& symTable() {
+    static SymTable table;
+    return table;
+  }
+
+  SymId internSym(const std::string& name) {
+    SymTable& table = symTable();
+    std::lock_guard<std::mutex> guard(table.lock);
+    std::unordered_map<std::string, SymId>::iterator it = table.ids.find(name);
+    if (it != table.ids.end()) {
+      return it->second;
+    }
+    SymId id = table.names.size();
+    table.names.push_back(name);
+    table.ids[name] = id;
+    return id;
+  }
+
+  const std::string& symName(const SymId& id) {
+    SymTable& table = symTable();
+    std::lock_guard<std::mutex> guard(table.lock);
+    return table.names[id];
+  }
+
+  SymId freshBinder() {
+    static std::atomic<SymId> next(0x80000000u);
+    return next++;
+  }
+
   ValSet EMPTY;
-  Scope::Scope() : base{nullptr} {}
-  Scope::Scope(Scope *base) : base{base} {}
-  void Scope::add(const SymId& k, ValSet& vs) {
-    this->data[k] = vs;
-  }
-  ValSet& Scope::get(const SymId& k) {
-    if (this->data.count(k)) {
-      return this->data.at(k);
-    } else if (this->base) {
-      return this->base->get(k);
+  const unsigned SCOPE_BITS = 5;
+  const std::uint32_t SCOPE_MASK = (1u << SCOPE_BITS) - 1;
+
+  std::size_t entryIndex(std::uint32_t bitmap, std::uint32_t bit) {
+    return std::bitset<32>(bitmap & (bit - 1)).count();
+  }
+
+  Scope::Scope() : count{0} {}
+  Scope::NodePtr Scope::merge(const Entry& e1, const Entry& e2, unsigned shift) {
+    std::shared_ptr<Node> node(new Node());
+    std::uint32_t bit1 = 1u << ((e1.key >> shift) & SCOPE_MASK);
+    std::uint32_t bit2 = 1u << ((e2.key >> shift) & SCOPE_MASK);
+    if (bit1 == bit2) {
+      node->bitmap = bit1;
+      node->entries.push_back(Entry{NULL_SYM, ValSetPtr(), merge(e1, e2, shift + SCOPE_BITS)});
     } else {
-      return EMPTY;
+      node->bitmap = bit1 | bit2;
+      if (bit1 < bit2) {
+        node->entries.push_back(e1);
+        node->entries.push_back(e2);
+      } else {
+        node->entries.push_back(e2);
+        node->entries.push_back(e1);
+      }
     }
+    return node;
+  }
+  Scope::NodePtr Scope::insert(const NodePtr& node, unsigned shift, const SymId& k, const ValSetPtr& vs, bool& added) {
+    std::uint32_t bit = 1u << ((k >> shift) & SCOPE_MASK);
+    std::shared_ptr<Node> res(node ? new Node(*node) : new Node{0, {}});
+    std::size_t idx = entryIndex(res->bitmap, bit);
+    if (!(res->bitmap & bit)) {
+      res->bitmap |= bit;
+      res->entries.insert(res->entries.begin() + idx, Entry{k, vs, NodePtr()});
+      added = true;
+    } else {
+      Entry& e = res->entries[idx];
+      if (e.child) {
+        e.child = insert(e.child, shift + SCOPE_BITS, k, vs, added);
+      } else if (e.key == k) {
+        e.vals = vs;
+      } else {
+        e.child = merge(e, Entry{k, vs, NodePtr()}, shift + SCOPE_BITS);
+        e.vals.reset();
+        added = true;
+      }
+    }
+    return res;
+  }
+  Scope::NodePtr Scope::remove(const NodePtr& node, unsigned shift, const SymId& k, bool& removed) {
+    std::uint32_t bit = 1u << ((k >> shift) & SCOPE_MASK);
+    if (!node || !(node->bitmap & bit)) {
+      return node;
+    }
+    std::size_t idx = entryIndex(node->bitmap, bit);
+    const Entry& e = node->entries[idx];
+    NodePtr child;
+    if (e.child) {
+      child = remove(e.child, shift + SCOPE_BITS, k, removed);
+      if (!removed) {
+        return node;
+      }
+    } else if (e.key == k) {
+      removed = true;
+    } else {
+      return node;
+    }
+    std::shared_ptr<Node> res(new Node(*node));
+    if (child) {
+      res->entries[idx].child = child;
+    } else {
+      res->bitmap &= ~bit;
+      res->entries.erase(res->entries.begin() + idx);
+      if (res->entries.empty()) {
+        return NodePtr();
+      }
+    }
+    return res;
+  }
+  void Scope::forEach(const NodePtr& node, const std::function<void(const Entry&)>& f) {
+    if (!node) {
+      return;
+    }
+    for (const Entry& e : node->entries) {
+      if (e.child) {
+        forEach(e.child, f);
+      } else {
+        f(e);
+      }
+    }
+  }
+  void Scope::add(const SymId& k, const ValSet& vs) {
+    this->add(k, ValSetPtr(new ValSet(vs)));
+  }
+  void Scope::add(const SymId& k, const std::shared_ptr<const ValSet>& vs) {
+    bool added = false;
+    this->root = insert(this->root, 0, k, vs, added);
+    if (added) {
+      ++this->count;
+    }
+  }
+  void Scope::remove(const SymId& k) {
+    bool removed = false;
+    this->root = remove(this->root, 0, k, removed);
+    if (removed) {
+      --this->count;
+    }
+  }
+  void Scope::extend(const Scope& other) {
+    forEach(other.root, [this](const Entry& e) {
+      this->add(e.key, e.vals);
+    });
+  }
+  const ValSet& Scope::get(const SymId& k) const {
+    const Node *node = this->root.get();
+    unsigned shift = 0;
+    while (node != nullptr) {
+      std::uint32_t bit = 1u << ((k >> shift) & SCOPE_MASK);
+      if (!(node->bitmap & bit)) {
+        break;
+      }
+      const Entry& e = node->entries[entryIndex(node->bitmap, bit)];
+      if (e.child) {
+        node = e.child.get();
+        shift += SCOPE_BITS;
+      } else if (e.key == k) {
+        return *e.vals;
+      } else {
+        break;
+      }
+    }
+    return EMPTY;
   }
   bool Scope::has(const SymId& k) const {
-    return this->data.count(k) || (this->base != nullptr && this->base->has(k));
+    return &this->get(k) != &EMPTY;
+  }
+  std::size_t Scope::size() const {
+    return this->count;
+  }
+  void Scope::forEach(const std::function<void(const SymId&, const ValSet&)>& f) const {
+    forEach(this->root, [&f](const Entry& e) {
+      f(e.key, *e.vals);
+    });
+  }
+  std::size_t Scope::hash() const {
+    std::size_t h = 0;
+    forEach(this->root, [&h](const Entry& e) {
+      h += hashMix(e.key, valSetHash(*e.vals));
+    });
+    return h;
   }
-  void Scope::squash_(std::unordered_map<SymId, ValSet>& out) {
-    if (this->base != nullptr) {
-      this->base->squash_(out);
+  bool Scope::operator==(const Scope& other) const {
+    if (this->count != other.count) {
+      return false;
     }
-    for (const std::pair<const SymId, ValSet>& kv : this->data) {
-      out[kv.first] = kv.second;
+    bool equal = true;
+    forEach(this->root, [&](const Entry& e) {
+      if (equal && (!other.has(e.key) || other.get(e.key) != *e.vals)) {
+        equal = false;
+      }
+    });
+    return equal;
+  }
+
+  ValPtr Trail::lookup(const SymId& k) const {
+    for (auto it = this->bindings.rbegin(); it != this->bindings.rend(); ++it) {
+      if (it->first == k) {
+        return it->second;
+      }
     }
+    return ValPtr();
   }
-  Scope Scope::squash() {
+  Scope Trail::toScope() const {
     Scope s;
-    this->squash_(s.data);
+    for (const std::pair<SymId, ValPtr>& binding : this->bindings) {
+      s.add(binding.first, ValSet({binding.second}, 1));
+    }
     return s;
   }
 
-  Shadow::Shadow(Scope *base): Scope(base) {}
-  void Shadow::shadow(const SymId& k) {
-    this->shadowed.insert(k);
+  SetStream::SetStream(ValSet&& vals) : vals(std::move(vals)), it(this->vals.begin()) {}
+  bool SetStream::next(ValPtr& out) {
+    if (this->it == this->vals.end()) {
+      return false;
+    }
+    out = *this->it;
+    ++this->it;
+    return true;
   }
-  bool Shadow::has(const SymId& k) const {
-    return this->data.count(k) || ((!this->shadowed.count(k)) && this->base->has(k));
+
+  UniqueStream::UniqueStream(ValStreamPtr&& source) : source(std::move(source)) {}
+  bool UniqueStream::next(ValPtr& out) {
+    while (this->source->next(out)) {
+      if (this->seen.insert(out).second) {
+        return true;
+      }
+    }
+    return false;
   }
-  void Shadow::squash_(std::unordered_map<SymId, ValSet>& out) {
-    if (this->base != nullptr) {
-      this->base->squash_(out);
+
+  ValSet collect(ValStreamPtr&& vs) {
+    ValSet res;
+    ValPtr val;
+    while (vs->next(val)) {
+      res.insert(val);
     }
-    for (const SymId& k : this->shadowed) {
-      out.erase(k);
+    return res;
+  }
+
+  Shape Shape::of(const ValPtr& v) {
+    ValPtr head = v;
+    std::size_t arity = 0;
+    while (const Apply *a = valCast<Apply>(head.get())) {
+      head = a->pred;
+      ++arity;
     }
-    for (const std::pair<const SymId, ValSet>& kv : this->data) {
-      out[kv.first] = kv.second;
+    if (head->kind == Kind::REF) {
+      return Shape();
     }
+    return Shape(head, arity);
+  }
+  std::size_t ShapeHash::operator()(const Shape& s) const {
+    return s.head ? hashMix(s.head->hash(), s.arity) : 0;
   }
 
-  ValTable::ValTable() {}
-  void ValTable::add_(std::vector<ValPtr>::iterator it, std::vector<ValPtr>::iterator end, const ValPtr& p) {
-    std::unordered_set<SymId> refIds;
-    (*it)->collectRefIds(refIds);
-    if (refIds.size() > 0) {
+  struct ValTable::Frozen {
+    struct Node {
+      std::uint32_t branchBegin, branchEnd;
+      std::uint32_t leafBegin, leafEnd;
+      std::uint32_t quantifiedBranchBegin, quantifiedBranchEnd;
+      std::uint32_t quantifiedLeafBegin, quantifiedLeafEnd;
+    };
+    struct Branch {
+      ValPtr key;
+      std::uint32_t child;
+    };
+    struct Leaf {
+      ValPtr key;
+      ValPtr decl;
+    };
+    struct QuantifiedBranch {
+      Shape shape;
+      ValPtr key;
+      std::uint32_t child;
+    };
+    struct QuantifiedLeaf {
+      Shape shape;
+      ValPtr key;
+      ValPtr decl;
+    };
+    std::vector<Node> nodes;
+    std::vector<Branch> branches;
+    std::vector<Leaf> leaves;
+    std::vector<QuantifiedBranch> quantified_branches;
+    std::vector<QuantifiedLeaf> quantified_leaves;
+  };
+
+  bool keyLess(const ValPtr& k1, const ValPtr& k2) {
+    return std::less<Value *>()(k1.get(), k2.get());
+  }
+  bool shapeLess(const Shape& s1, const Shape& s2) {
+    if (s1.head != s2.head) {
+      return keyLess(s1.head, s2.head);
+    }
+    return s1.arity < s2.arity;
+  }
+  template <typename T>
+  const T *findKey(const std::vector<T>& v, std::uint32_t begin, std::uint32_t end, const ValPtr& key) {
+    const T *found = std::lower_bound(v.data() + begin, v.data() + end, key, [](const T& e, const ValPtr& k) {
+      return keyLess(e.key, k);
+    });
+    return (found != v.data() + end && found->key == key) ? found : nullptr;
+  }
+  template <typename T>
+  std::pair<const T *, const T *> shapeRange(const std::vector<T>& v, std::uint32_t begin, std::uint32_t end, const Shape& shape) {
+    const T *first = std::lower_bound(v.data() + begin, v.data() + end, shape, [](const T& e, const Shape& s) {
+      return shapeLess(e.shape, s);
+    });
+    const T *last = std::upper_bound(first, v.data() + end, shape, [](const Shape& s, const T& e) {
+      return shapeLess(s, e.shape);
+    });
+    return std::pair<const T *, const T *>(first, last);
+  }
+
+  ValPtr extractApply(const ValPtr& p);
+  bool isRule(const ValPtr& decl);
+
+  const std::size_t ValTable::RECENT_LIMIT;
+  ValTable::ValTable() : recentAdds{0} {}
+  ValTable::~ValTable() {}
+  void ValTable::add_(std::vector<ValPtr>::iterator it, std::vector<ValPtr>::iterator end, const ValPtr& p, ValTable *root) {
+    if ((*it)->hasRefs()) {
+      Shape shape = Shape::of(*it);
       if (it+1 == end) {
-        this->quantified_leaves.push_back(std::pair<ValPtr, ValPtr>(*it, p));
+        this->quantified_leaves[shape].push_back(std::pair<ValPtr, ValPtr>(*it, p));
+        if (root) {
+          root->quantified_leaf_index[shape].push_back(std::pair<ValPtr, ValPtr>(*it, p));
+          ++root->stats[Shape::of(extractApply(p))].quantified;
+        }
       } else {
         std::shared_ptr<ValTable> vtp = std::shared_ptr<ValTable>(new ValTable());
-        vtp->add_(it+1, end, p);
-        this->quantified_branches.push_back(std::pair<ValPtr, std::shared_ptr<ValTable>>(*it, vtp));
+        vtp->add_(it+1, end, p, root);
+        this->quantified_branches[shape].push_back(std::pair<ValPtr, std::shared_ptr<ValTable>>(*it, vtp));
       }
     } else {
       if (it+1 == end) {
+        auto found = this->leaves.find(*it);
+        if (root) {
+          ShapeStats& stats = root->stats[Shape::of(extractApply(p))];
+          if (found == this->leaves.end()) {
+            root->leaf_index[Shape::of(*it)].push_back(std::pair<const ValTable *, ValPtr>(this, *it));
+          } else {
+            // The replaced decl has the same path, so the same shape
+            --(found->second->hasRefs() || isRule(found->second) ? stats.quantified : stats.ground);
+          }
+          // A ground decl that still has to be proved, such as [b] a, is
+          // counted as a rule for the atom inside it
+          ++(p->hasRefs() || isRule(p) ? stats.quantified : stats.ground);
+        }
         this->leaves[*it] = p;
       } else {
         if (!this->branches.count(*it)) {
           this->branches[*it] = std::shared_ptr<ValTable>(new ValTable());
         }
-        this->branches[*it]->add_(it+1, end, p);
+        this->branches[*it]->add_(it+1, end, p, root);
       }
     }
   }
+  bool isRule(const ValPtr& decl) {
+    return decl->kind == Kind::CONSTRAIN || decl->kind == Kind::DECLARE;
+  }
   ValPtr stripLambdas(const ValPtr& p) {
-    if (const Lambda *l = dynamic_cast<const Lambda *>(p.get())) {
-      return stripLambdas(l->body);
-    } else if (const Declare *d = dynamic_cast<const Declare *>(p.get())) {
+    switch (p->kind) {
+    case Kind::LAMBDA:
+      return stripLambdas(static_cast<const Lambda *>(p.get())->body);
+    case Kind::DECLARE: {
+      const Declare *d = static_cast<const Declare *>(p.get());
       ValPtr newBody = stripLambdas(d->body);
       if (newBody != d->body)
         return bundle(new Declare(d->with, newBody));
       else
         return p;
-    } else if (const Constrain *c = dynamic_cast<const Constrain *>(p.get())) {
+    }
+    case Kind::CONSTRAIN: {
+      const Constrain *c = static_cast<const Constrain *>(p.get());
       ValPtr newBody = stripLambdas(c->body);
       if (newBody != c->body)
         return bundle(new Constrain(c->constraint, newBody));
       else
         return p;
-    } else {
+    }
+    default:
+      return p;
+    }
+  }
+  ValPtr extractApply(const ValPtr& p) {
+    switch (p->kind) {
+    case Kind::LAMBDA:
+      return extractApply(static_cast<const Lambda *>(p.get())->body);
+    case Kind::DECLARE:
+      return extractApply(static_cast<const Declare *>(p.get())->body);
+    case Kind::CONSTRAIN:
+      return extractApply(static_cast<const Constrain *>(p.get())->body);
+    default:
+      return p;
+    }
+  }
+  Value& getVal(const ValPtr& vp) {
+    return *vp;
+  }
+  bool ValTable::add(const ValPtr& p) {
+    std::vector<ValPtr> v;
+    ValPtr p2 = stripLambdas(p);
+    extractApply(p2)->flatten(v);
+    const ValPtr *replaced = this->findLeaf_(v);
+    if (replaced && *replaced == p2) {
+      return false;
+    }
+    bool newFirst = !this->hasFirst_(v[0]);
+    this->add_(v.begin(), v.end(), p2, this);
+    if (!this->frozen) {
+      return newFirst;
+    }
+    // Replacing a frozen leaf, or a full overlay, needs a fresh layout
+    if (replaced || this->recentAdds >= RECENT_LIMIT) {
+      this->frozen.reset();
+      this->recent.reset();
+      this->recentAdds = 0;
+      return newFirst;
+    }
+    if (!this->recent) {
+      this->recent.reset(new ValTable());
+    }
+    this->recent->add_(v.begin(), v.end(), p2, nullptr);
+    this->recent->frozen.reset();
+    ++this->recentAdds;
+    return newFirst;
+  }
+  bool ValTable::hasFirst_(const ValPtr& first) const {
+    if (first->hasRefs()) {
+      Shape shape = Shape::of(first);
+      return this->quantified_branches.count(shape) || this->quantified_leaves.count(shape);
+    }
+    return this->branches.count(first) || this->leaves.count(first);
+  }
+  const ValPtr *ValTable::findLeaf_(const std::vector<ValPtr>& path) const {
+    const ValTable *table = this;
+    for (std::size_t i = 0; i + 1 < path.size(); ++i) {
+      if (path[i]->hasRefs()) {
+        return nullptr;
+      }
+      auto found = table->branches.find(path[i]);
+      if (found == table->branches.end()) {
+        return nullptr;
+      }
+      table = found->second.get();
+    }
+    if (path.back()->hasRefs()) {
+      return nullptr;
+    }
+    auto found = table->leaves.find(path.back());
+    return found != table->leaves.end() ? &found->second : nullptr;
+  }
+  std::uint32_t ValTable::freeze_(Frozen& f) const {
+    std::uint32_t idx = f.nodes.size();
+    f.nodes.push_back(Frozen::Node());
+    Frozen::Node node;
+    std::vector<std::pair<ValPtr, const ValTable *>> children;
+    for (const std::pair<const ValPtr, std::shared_ptr<ValTable>>& branch : this->branches) {
+      children.push_back(std::pair<ValPtr, const ValTable *>(branch.first, branch.second.get()));
+    }
+    std::sort(children.begin(), children.end(), [](const std::pair<ValPtr, const ValTable *>& c1, const std::pair<ValPtr, const ValTable *>& c2) {
+      return keyLess(c1.first, c2.first);
+    });
+    node.branchBegin = f.branches.size();
+    for (const std::pair<ValPtr, const ValTable *>& child : children) {
+      f.branches.push_back(Frozen::Branch{child.first, 0});
+    }
+    node.branchEnd = f.branches.size();
+    node.leafBegin = f.leaves.size();
+    for (const std::pair<const ValPtr, ValPtr>& leaf : this->leaves) {
+      f.leaves.push_back(Frozen::Leaf{leaf.first, leaf.second});
+    }
+    std::sort(f.leaves.begin() + node.leafBegin, f.leaves.end(), [](const Frozen::Leaf& l1, const Frozen::Leaf& l2) {
+      return keyLess(l1.key, l2.key);
+    });
+    node.leafEnd = f.leaves.size();
+    std::vector<const ValTable *> quantifiedChildren;
+    node.quantifiedBranchBegin = f.quantified_branches.size();
+    for (const std::pair<const Shape, QuantifiedBranches>& bucket : this->quantified_branches) {
+      for (const std::pair<ValPtr, std::shared_ptr<ValTable>>& branch : bucket.second) {
+        f.quantified_branches.push_back(Frozen::QuantifiedBranch{bucket.first, branch.first, static_cast<std::uint32_t>(quantifiedChildren.size())});
+        quantifiedChildren.push_back(branch.second.get());
+      }
+    }
+    std::stable_sort(f.quantified_branches.begin() + node.quantifiedBranchBegin, f.quantified_branches.end(), [](const Frozen::QuantifiedBranch& b1, const Frozen::QuantifiedBranch& b2) {
+      return shapeLess(b1.shape, b2.shape);
+    });
+    node.quantifiedBranchEnd = f.quantified_branches.size();
+    node.quantifiedLeafBegin = f.quantified_leaves.size();
+    for (const std::pair<const Shape, QuantifiedLeaves>& bucket : this->quantified_leaves) {
+      for (const std::pair<ValPtr, ValPtr>& leaf : bucket.second) {
+        f.quantified_leaves.push_back(Frozen::QuantifiedLeaf{bucket.first, leaf.first, leaf.second});
+      }
+    }
+    std::stable_sort(f.quantified_leaves.begin() + node.quantifiedLeafBegin, f.quantified_leaves.end(), [](const Frozen::QuantifiedLeaf& l1, const Frozen::QuantifiedLeaf& l2) {
+      return shapeLess(l1.shape, l2.shape);
+    });
+    node.quantifiedLeafEnd = f.quantified_leaves.size();
+    f.nodes[idx] = node;
+    for (std::uint32_t i = 0; i < children.size(); ++i) {
+      std::uint32_t child = children[i].second->freeze_(f);
+      f.branches[node.branchBegin + i].child = child;
+    }
+    for (std::uint32_t i = node.quantifiedBranchBegin; i < node.quantifiedBranchEnd; ++i) {
+      std::uint32_t child = quantifiedChildren[f.quantified_branches[i].child]->freeze_(f);
+      f.quantified_branches[i].child = child;
+    }
+    return idx;
+  }
+  void ValTable::addAll(const std::vector<ValPtr>& ps) {
+    Paths paths(ps.size());
+    for (std::size_t i = 0; i < ps.size(); ++i) {
+      paths[i].second = stripLambdas(ps[i]);
+      extractApply(paths[i].second)->flatten(paths[i].first);
+    }
+    std::stable_sort(paths.begin(), paths.end(), [](const Paths::value_type& p1, const Paths::value_type& p2) {
+      return std::lexicographical_compare(p1.first.begin(), p1.first.end(), p2.first.begin(), p2.first.end(), keyLess);
+    });
+    this->addPaths_(paths.begin(), paths.end(), 0, *this);
+    this->frozen.reset();
+    this->recent.reset();
+    this->recentAdds = 0;
+  }
+  void ValTable::addPaths_(Paths::iterator begin, Paths::iterator end, std::size_t depth, ValTable& root) {
+    Paths::iterator it = begin;
+    while (it != end) {
+      const ValPtr& key = it->first[depth];
+      if (key->hasRefs() || it->first.size() == depth + 1) {
+        this->add_(it->first.begin() + depth, it->first.end(), it->second, &root);
+        ++it;
+        continue;
+      }
+      Paths::iterator runEnd = it;
+      while (runEnd != end && runEnd->first[depth] == key && runEnd->first.size() > depth + 1) {
+        ++runEnd;
+      }
+      std::shared_ptr<ValTable>& child = this->branches[key];
+      if (!child) {
+        child = std::shared_ptr<ValTable>(new ValTable());
+      }
+      child->addPaths_(it, runEnd, depth + 1, root);
+      it = runEnd;
+    }
+  }
+  bool ValTable::empty() const {
+    return this->branches.empty() && this->leaves.empty() && this->quantified_branches.empty() && this->quantified_leaves.empty();
+  }
+  // Plain first keys are never Applies and only match themselves, so the
+  // shape of a lookup's first key says all there is about it
+  bool ValTable::mayMatchShape(const Shape& shape) const {
+    if (!shape.head) {
+      return !this->empty();
+    }
+    bool plain = shape.arity == 0 && (this->branches.count(shape.head) || this->leaves.count(shape.head));
+    return plain
+      || this->quantified_branches.count(shape) || this->quantified_leaves.count(shape)
+      || this->quantified_branches.count(Shape()) || this->quantified_leaves.count(Shape());
+  }
+  ShapeStats ValTable::statsFor(const Shape& shape) const {
+    ShapeStats res;
+    if (!shape.head) {
+      for (const std::pair<const Shape, ShapeStats>& entry : this->stats) {
+        res.ground += entry.second.ground;
+        res.quantified += entry.second.quantified;
+      }
+      return res;
+    }
+    for (const Shape& key : {shape, Shape()}) {
+      auto found = this->stats.find(key);
+      if (found != this->stats.end()) {
+        res.ground += found->second.ground;
+        res.quantified += found->second.quantified;
+      }
+    }
+    return res;
+  }
+  void ValTable::freeze() {
+    if (!this->frozen) {
+      this->frozen.reset(new Frozen());
+      this->freeze_(*this->frozen);
+    }
+    if (this->recent) {
+      this->recent->freeze();
+    }
+  }
+  bool provable(const ValPtr& decl, Scope& s, World& w) {
+    ValPtr proof;
+    return decl->stream(s, w)->next(proof);
+  }
+
+  // Set once enough sibling proofs have succeeded; searches below it stop
+  // early. Cutting a search short only loses answers, so a proof that still
+  // succeeds under a cancelled token is a real proof.
+  struct CancelToken {
+    std::atomic<bool> cancelled;
+    const CancelToken *parent;
+  };
+  thread_local const CancelToken *cancelToken(nullptr);
+  bool cancelled() {
+    for (const CancelToken *t = cancelToken; t != nullptr; t = t->parent) {
+      if (t->cancelled) {
+        return true;
+      }
+    }
+    return false;
+  }
+  class UseCancelToken {
+  private:
+    const CancelToken *prev;
+  public:
+    UseCancelToken(const CancelToken *token) : prev{cancelToken} {
+      cancelToken = token;
+    }
+    ~UseCancelToken() {
+      cancelToken = this->prev;
+    }
+  };
+  bool canOrFork(const World& w) {
+    return WorkPool::instance() && w.isOrParallel() && !w.isTabling();
+  }
+
+  // Proves the candidates of one leaf scan. Serially each is proved as it
+  // is offered; in OR-parallel mode they are collected and the rule bodies
+  // proved concurrently, each task starting from a copy of the step stack.
+  class LeafProofs {
+  private:
+    struct Candidate {
+      ValPtr decl;
+      Scope bs;
+      Scope as;
+    };
+    const ValPtr& goal;
+    World& w;
+    std::vector<std::pair<ValPtr, Scope>>& out;
+    std::size_t limit;
+    bool parallel;
+    std::vector<Candidate> pending;
+    bool prove(const Candidate& c) {
+      this->w.pushStep(CheckStep(this->goal, c.decl));
+      Scope bs(c.bs);
+      bool proved = provable(c.decl, bs, this->w);
+      this->w.popStep();
+      return proved;
+    }
+  public:
+    LeafProofs(const ValPtr& goal, World& w, std::vector<std::pair<ValPtr, Scope>>& out, std::size_t limit) : goal(goal), w(w), out(out), limit{limit}, parallel{canOrFork(w)} {}
+    void offer(const ValPtr& decl, const Trail& a, const Trail& b) {
+      Candidate c{decl, b.toScope(), Scope()};
+      if (this->parallel) {
+        c.as = a.toScope();
+        this->pending.push_back(std::move(c));
+      } else if (this->prove(c)) {
+        this->out.push_back(std::pair<ValPtr, Scope>{decl, a.toScope()});
+      }
+    }
+    void finish() {
+      std::vector<char> proved(this->pending.size(), 0);
+      std::vector<std::size_t> rules;
+      std::size_t wanted = this->limit - this->out.size();
+      std::size_t found = 0;
+      for (std::size_t i = 0; i < this->pending.size(); ++i) {
+        if (isRule(this->pending[i].decl)) {
+          rules.push_back(i);
+        } else if (found < wanted) {
+          proved[i] = this->prove(this->pending[i]);
+          found += proved[i];
+        }
+      }
+      if (rules.size() == 1 && found < wanted) {
+        proved[rules[0]] = this->prove(this->pending[rules[0]]);
+      } else if (rules.size() > 1 && found < wanted) {
+        this->w.freezeLayers();
+        World::Steps steps(this->w);
+        Arena& outer = Arena::current();
+        CancelToken token{{false}, cancelToken};
+        std::atomic<std::size_t> successes(found);
+        std::vector<std::function<void()>> tasks;
+        for (std::size_t i : rules) {
+          tasks.push_back([this, &proved, &steps, &outer, &token, &successes, wanted, i]() {
+            if (token.cancelled) {
+              return;
+            }
+            Arena arena(&outer);
+            UseArena use(arena);
+            World::Task task(steps);
+            UseCancelToken useToken(&token);
+            proved[i] = this->prove(this->pending[i]);
+            if (proved[i] && ++successes >= wanted) {
+              token.cancelled = true;
+            }
+          });
+        }
+        WorkPool::instance()->run(tasks);
+      }
+      for (std::size_t i = 0; i < this->pending.size() && this->out.size() < this->limit; ++i) {
+        if (proved[i]) {
+          this->out.push_back(std::pair<ValPtr, Scope>{this->pending[i].decl, this->pending[i].as});
+        }
+      }
+      this->pending.clear();
+    }
+  };
+
+  class MatchListStream: public MatchStream {
+  private:
+    std::vector<std::pair<ValPtr, Scope>> matches;
+    std::size_t idx;
+  public:
+    MatchListStream(std::vector<std::pair<ValPtr, Scope>>&& matches) : matches(std::move(matches)), idx{0} {}
+    bool next(std::pair<ValPtr, Scope>& out) override {
+      if (this->idx >= this->matches.size()) {
+        return false;
+      }
+      out = std::move(this->matches[this->idx++]);
+      return true;
+    }
+  };
+
+  // Opens each source only once the ones before it are used up
+  class MatchChain: public MatchStream {
+  private:
+    std::vector<std::function<MatchStreamPtr(std::size_t)>> sources;
+    std::size_t limit;
+    std::size_t produced;
+    std::size_t idx;
+    MatchStreamPtr curr;
+  public:
+    MatchChain(std::vector<std::function<MatchStreamPtr(std::size_t)>>&& sources, std::size_t limit) : sources(std::move(sources)), limit{limit}, produced{0}, idx{0} {}
+    bool next(std::pair<ValPtr, Scope>& out) override {
+      while (true) {
+        if (this->curr && this->curr->next(out)) {
+          ++this->produced;
+          return true;
+        }
+        if (this->idx >= this->sources.size() || cancelled()) {
+          this->curr.reset();
+          return false;
+        }
+        this->curr = this->sources[this->idx++](this->limit - this->produced);
+      }
+    }
+  };
+
+  void drain(MatchStream& matches, std::vector<std::pair<ValPtr, Scope>>& out, std::size_t limit) {
+    std::pair<ValPtr, Scope> match;
+    while (out.size() < limit && matches.next(match)) {
+      out.push_back(std::move(match));
+    }
+  }
+
+  // A search of the index that does a bounded amount of work per step and
+  // hands back each match as soon as it is proved
+  class IndexWalk: public MatchStream {
+  protected:
+    std::vector<std::pair<ValPtr, Scope>> ready;
+    std::size_t readyIdx;
+    std::size_t limit;
+    std::size_t produced;
+    std::unique_ptr<LeafProofs> proofs;
+    // False once the walk is over
+    virtual bool step() = 0;
+    std::size_t remaining() const {
+      return this->limit - this->produced;
+    }
+  public:
+    IndexWalk(std::size_t limit) : readyIdx{0}, limit{limit}, produced{0} {}
+    bool next(std::pair<ValPtr, Scope>& out) override {
+      while (this->readyIdx == this->ready.size()) {
+        this->ready.clear();
+        this->readyIdx = 0;
+        if (!this->step()) {
+          return false;
+        }
+      }
+      out = std::move(this->ready[this->readyIdx++]);
+      ++this->produced;
+      return true;
+    }
+  };
+
+  // Walks the frozen trie below one node on an explicit stack rather than
+  // by recursion, so the walk can stop after any match and resume later
+  class ValTable::PathWalk: public IndexWalk {
+  private:
+    enum class Stage : std::uint8_t {START, SCAN, QUANTIFIED, DONE};
+    struct Frame {
+      std::uint32_t node;
+      std::size_t depth;
+      Stage stage;
+      Shape shape;
+      std::uint32_t pos;
+      std::uint32_t end;
+      Trail *undo;
+      std::size_t mark;
+    };
+    const Frozen& f;
+    ValPtr val;
+    std::vector<ValPtr> path;
+    World& w;
+    Trail a;
+    Trail b;
+    std::vector<Frame> frames;
+    void push(std::uint32_t node, std::size_t depth, Trail *undo, std::size_t mark) {
+      if (cancelled()) {
+        if (undo) {
+          undo->undo(mark);
+        }
+        return;
+      }
+      this->frames.push_back(Frame{node, depth, Stage::START, Shape(), 0, 0, undo, mark});
+    }
+    void pop() {
+      const Frame& fr = this->frames.back();
+      if (fr.undo) {
+        fr.undo->undo(fr.mark);
+      }
+      this->frames.pop_back();
+    }
+    // Moves on to the frame's quantified entries of the given shape
+    void quantified(Frame& fr, const Shape& shape) {
+      const Frozen::Node& node = this->f.nodes[fr.node];
+      if (fr.depth + 1 == this->path.size()) {
+        std::pair<const Frozen::QuantifiedLeaf *, const Frozen::QuantifiedLeaf *> range = shapeRange(this->f.quantified_leaves, node.quantifiedLeafBegin, node.quantifiedLeafEnd, shape);
+        fr.pos = range.first - this->f.quantified_leaves.data();
+        fr.end = range.second - this->f.quantified_leaves.data();
+      } else {
+        std::pair<const Frozen::QuantifiedBranch *, const Frozen::QuantifiedBranch *> range = shapeRange(this->f.quantified_branches, node.quantifiedBranchBegin, node.quantifiedBranchEnd, shape);
+        fr.pos = range.first - this->f.quantified_branches.data();
+        fr.end = range.second - this->f.quantified_branches.data();
+      }
+      fr.shape = shape;
+      fr.stage = Stage::QUANTIFIED;
+    }
+    bool step() override {
+      if (this->frames.empty()) {
+        return false;
+      }
+      Frame& fr = this->frames.back();
+      const Frozen::Node& node = this->f.nodes[fr.node];
+      const ValPtr& key = this->path[fr.depth];
+      bool leaf = fr.depth + 1 == this->path.size();
+      if (leaf && fr.stage != Stage::START && fr.stage != Stage::DONE && cancelled()) {
+        this->proofs.reset();
+        this->pop();
+        return true;
+      }
+      switch (fr.stage) {
+      case Stage::START:
+        if (leaf) {
+          this->proofs.reset(new LeafProofs(this->val, this->w, this->ready, this->remaining()));
+        }
+        if (key->hasRefs()) {
+          fr.stage = Stage::SCAN;
+          fr.pos = leaf ? node.leafBegin : node.branchBegin;
+          fr.end = leaf ? node.leafEnd : node.branchEnd;
+          return true;
+        }
+        this->quantified(fr, Shape::of(key));
+        if (!leaf) {
+          if (const Frozen::Branch *branch = findKey(this->f.branches, node.branchBegin, node.branchEnd, key)) {
+            this->push(branch->child, fr.depth + 1, nullptr, 0);
+          }
+        } else if (const Frozen::Leaf *found = findKey(this->f.leaves, node.leafBegin, node.leafEnd, key)) {
+          if (this->w.isLegal(CheckStep(this->val, found->decl))) {
+            this->proofs->offer(found->decl, this->a, this->b);
+          }
+        }
+        return true;
+      case Stage::SCAN:
+        if (fr.pos == fr.end) {
+          this->quantified(fr, Shape::of(key));
+        } else if (leaf) {
+          const Frozen::Leaf& found = this->f.leaves[fr.pos++];
+          if (this->w.isLegal(CheckStep(this->val, found.decl))) {
+            std::size_t mark = this->a.mark();
+            if (key->match(found.key, this->a)) {
+              this->proofs->offer(found.decl, this->a, this->b);
+            }
+            this->a.undo(mark);
+          }
+        } else {
+          const Frozen::Branch& branch = this->f.branches[fr.pos++];
+          std::size_t mark = this->a.mark();
+          if (key->match(branch.key, this->a)) {
+            this->push(branch.child, fr.depth + 1, &this->a, mark);
+          } else {
+            this->a.undo(mark);
+          }
+        }
+        return true;
+      case Stage::QUANTIFIED:
+        if (fr.pos == fr.end) {
+          if (fr.shape.head) {
+            this->quantified(fr, Shape());
+          } else {
+            fr.stage = Stage::DONE;
+          }
+        } else if (leaf) {
+          const Frozen::QuantifiedLeaf& found = this->f.quantified_leaves[fr.pos++];
+          if (this->w.isLegal(CheckStep(this->val, found.decl))) {
+            std::size_t mark = this->b.mark();
+            if (found.key->match(key, this->b)) {
+              this->proofs->offer(found.decl, this->a, this->b);
+            }
+            this->b.undo(mark);
+          }
+        } else {
+          const Frozen::QuantifiedBranch& branch = this->f.quantified_branches[fr.pos++];
+          std::size_t mark = this->b.mark();
+          if (branch.key->match(key, this->b)) {
+            this->push(branch.child, fr.depth + 1, &this->b, mark);
+          } else {
+            this->b.undo(mark);
+          }
+        }
+        return true;
+      case Stage::DONE:
+        if (leaf) {
+          this->proofs->finish();
+          this->proofs.reset();
+        }
+        this->pop();
+        return true;
+      }
+      return false;
+    }
+  public:
+    // Starts at the given depth of the path; a walk that only wants the
+    // quantified branches of its first node skips straight to them
+    PathWalk(const ValTable& table, std::uint32_t node, const ValPtr& val, const std::vector<ValPtr>& path, std::size_t depth, bool quantifiedOnly, World& w, std::size_t limit) : IndexWalk(limit), f(*table.frozen), val(val), path(path), w(w) {
+      this->push(node, depth, nullptr, 0);
+      if (quantifiedOnly && !this->frames.empty()) {
+        this->quantified(this->frames.back(), Shape::of(this->path[depth]));
+      }
+    }
+  };
+
+  // Matches a goal against whole leaves through the shape index
+  class ValTable::WholeValWalk: public IndexWalk {
+  private:
+    typedef std::vector<std::pair<const ValTable *, ValPtr>> Bucket;
+    ValPtr val;
+    World& w;
+    Trail a;
+    Trail b;
+    std::vector<const Bucket *> buckets;
+    std::vector<const QuantifiedLeaves *> quantifiedBuckets;
+    std::size_t bucketIdx;
+    std::size_t entryIdx;
+    bool done;
+    bool step() override {
+      if (this->done) {
+        return false;
+      }
+      std::size_t numBuckets = this->buckets.size();
+      bool ground = this->bucketIdx < numBuckets;
+      if (this->bucketIdx == numBuckets + this->quantifiedBuckets.size()) {
+        this->proofs->finish();
+        this->done = true;
+        return true;
+      }
+      std::size_t size = ground ? this->buckets[this->bucketIdx]->size() : this->quantifiedBuckets[this->bucketIdx - numBuckets]->size();
+      if (this->entryIdx == size) {
+        ++this->bucketIdx;
+        this->entryIdx = 0;
+        return true;
+      }
+      if (cancelled()) {
+        this->done = true;
+        return false;
+      }
+      if (ground) {
+        const std::pair<const ValTable *, ValPtr>& entry = (*this->buckets[this->bucketIdx])[this->entryIdx++];
+        const ValPtr& decl = entry.first->leaves.at(entry.second);
+        if (this->w.isLegal(CheckStep(this->val, decl))) {
+          std::size_t mark = this->a.mark();
+          if (this->val->match(entry.second, this->a)) {
+            this->proofs->offer(decl, this->a, this->b);
+          }
+          this->a.undo(mark);
+        }
+      } else {
+        const std::pair<ValPtr, ValPtr>& leaf = (*this->quantifiedBuckets[this->bucketIdx - numBuckets])[this->entryIdx++];
+        if (this->w.isLegal(CheckStep(this->val, leaf.second))) {
+          std::size_t mark = this->b.mark();
+          if (leaf.first->match(this->val, this->b)) {
+            this->proofs->offer(leaf.second, this->a, this->b);
+          }
+          this->b.undo(mark);
+        }
+      }
+      return true;
+    }
+  public:
+    WholeValWalk(const ValTable& table, const ValPtr& val, World& w, std::size_t limit) : IndexWalk(limit), val(val), w(w), bucketIdx{0}, entryIdx{0}, done{false} {
+      Shape shape = Shape::of(val);
+      if (shape.head) {
+        auto bucket = table.leaf_index.find(shape);
+        if (bucket != table.leaf_index.end()) {
+          this->buckets.push_back(&bucket->second);
+        }
+      } else {
+        for (const std::pair<const Shape, Bucket>& bucket : table.leaf_index) {
+          this->buckets.push_back(&bucket.second);
+        }
+      }
+      for (const Shape& key : {shape, Shape()}) {
+        auto bucket = table.quantified_leaf_index.find(key);
+        if (bucket != table.quantified_leaf_index.end()) {
+          this->quantifiedBuckets.push_back(&bucket->second);
+        }
+        if (!key.head) {
+          break;
+        }
+      }
+      this->proofs.reset(new LeafProofs(this->val, this->w, this->ready, limit));
+    }
+  };
+
+  MatchStreamPtr ValTable::stream_matches_whole_val(const ValPtr& val, World& w, std::size_t limit) {
+    return MatchStreamPtr(new WholeValWalk(*this, val, w, limit));
+  }
+  MatchStreamPtr ValTable::stream_matches(const ValPtr& val, const std::vector<ValPtr>& path, World& w, std::size_t limit) {
+    this->freeze();
+    if (!this->recent) {
+      return MatchStreamPtr(new PathWalk(*this, 0, val, path, 0, false, w, limit));
+    }
+    std::vector<std::function<MatchStreamPtr(std::size_t)>> sources;
+    for (const ValTable *table : {static_cast<const ValTable *>(this), static_cast<const ValTable *>(this->recent.get())}) {
+      sources.push_back([table, val, path, &w](std::size_t limit) {
+        return MatchStreamPtr(new PathWalk(*table, 0, val, path, 0, false, w, limit));
+      });
+    }
+    return MatchStreamPtr(new MatchChain(std::move(sources), limit));
+  }
+  void ValTable::get_matches_batch(std::vector<BatchGoal *>& goals, World& w) {
+    this->freeze();
+    this->get_matches_batch_(0, 0, goals, w);
+    if (this->recent) {
+      this->recent->get_matches_batch_(0, 0, goals, w);
+    }
+  }
+  // Goals that agree on a ground key descend its branch together, so a
+  // shared prefix is looked up once per group rather than once per goal
+  void ValTable::get_matches_batch_(std::uint32_t n, std::size_t depth, std::vector<BatchGoal *>& goals, World& w) const {
+    if (cancelled()) {
+      return;
+    }
+    const Frozen& f = *this->frozen;
+    const Frozen::Node& node = f.nodes[n];
+    std::vector<BatchGoal *> ground;
+    std::unordered_map<ValPtr, std::vector<BatchGoal *>, ValPtrHash, ValPtrEqual> byKey;
+    std::vector<ValPtr> keys;
+    for (BatchGoal *goal : goals) {
+      std::vector<ValPtr>::iterator it = goal->flat.begin() + depth;
+      if (goal->out.size() >= goal->limit) {
+        continue;
+      }
+      if (it+1 == goal->flat.end() || (*it)->hasRefs()) {
+        PathWalk walk(*this, n, goal->val, goal->flat, depth, false, w, goal->limit - goal->out.size());
+        drain(walk, goal->out, goal->limit);
+        continue;
+      }
+      ground.push_back(goal);
+      std::vector<BatchGoal *>& group = byKey[*it];
+      if (group.empty()) {
+        keys.push_back(*it);
+      }
+      group.push_back(goal);
+    }
+    for (const ValPtr& key : keys) {
+      if (const Frozen::Branch *branch = findKey(f.branches, node.branchBegin, node.branchEnd, key)) {
+        this->get_matches_batch_(branch->child, depth + 1, byKey[key], w);
+      }
+    }
+    for (BatchGoal *goal : ground) {
+      if (goal->out.size() < goal->limit) {
+        PathWalk walk(*this, n, goal->val, goal->flat, depth, true, w, goal->limit - goal->out.size());
+        drain(walk, goal->out, goal->limit);
+      }
+    }
+  }
+
+  CheckStep::CheckStep(const ValPtr& goal, const ValPtr& chosenDecl) : goal(goal), chosenDecl(chosenDecl) {}
+  bool CheckStep::operator==(const CheckStep& other) const {
+    //return (*other.goal) == (*this->goal) && other.chosenDecl.get() == this->chosenDecl.get();
+    return other.chosenDecl.get() == this->chosenDecl.get();
+  }
+
+  std::size_t World::getNumStepsTaken() const {
+    return this->state().stepsTaken.size();
+  }
+  const std::uint64_t STEP_HASH_BASE = 0x100000001b3ULL;
+  std::uint64_t World::stepRangeHash(std::size_t begin, std::size_t end) const {
+    SearchState& st = this->state();
+    return st.stepHashes[end] - st.stepHashes[begin] * st.stepPowers[end - begin];
+  }
+  std::atomic<std::size_t> worldConsultations(0);
+  thread_local std::unordered_map<const World *, World::SearchState> *World::taskStates(nullptr);
+  World::Steps::Steps(const World& w) {
+    for (const World *curr = &w; curr != nullptr; curr = curr->base) {
+      const SearchState& from = curr->state();
+      SearchState& to = this->states[curr];
+      to.stepsTaken = from.stepsTaken;
+      to.stepHashes = from.stepHashes;
+      to.stepPowers = from.stepPowers;
+      to.stepPositions = from.stepPositions;
+    }
+  }
+  World::Task::Task() : prev{taskStates} {
+    taskStates = &this->states;
+  }
+  World::Task::Task(const Steps& steps) : states(steps.states), prev{taskStates} {
+    taskStates = &this->states;
+  }
+  World::Task::~Task() {
+    taskStates = this->prev;
+  }
+  World::Query::Query() : arena(&Arena::current()), use(this->arena) {}
+  World::Query::Query(const Arena& outer) : arena(&outer), use(this->arena) {}
+  World::SearchState::SearchState() : stepHashes({0}), stepPowers({1}), layersVersion{SIZE_MAX}, tablesVersion{0}, answerCount{0} {}
+  World::World() : base{nullptr}, numPrevSteps{0}, tabling{false}, orParallel{false}, version{0}, keysVersion{0}, evalHits{0}, evalMisses{0}, evalEvictions{0} {}
+  World::World(World *base) : base{base}, numPrevSteps{base ? base->getNumStepsTaken() : 0}, tabling{base ? base->tabling : false}, orParallel{base ? base->orParallel : false}, version{0}, keysVersion{0}, evalHits{0}, evalMisses{0}, evalEvictions{0} {}
+  World::~World() {
+    if (taskStates) {
+      taskStates->erase(this);
+    }
+  }
+  World::SearchState& World::state() const {
+    if (taskStates) {
+      return (*taskStates)[this];
+    }
+    return this->mainState;
+  }
+  void World::add(const ValPtr& p) {
+    if (this->data.add(p)) {
+      ++this->keysVersion;
+    }
+    ++this->version;
+  }
+  void World::addAll(const std::vector<ValPtr>& ps) {
+    this->data.addAll(ps);
+    ++this->keysVersion;
+    ++this->version;
+  }
+  std::size_t World::chainVersion() const {
+    std::size_t v = 0;
+    for (const World *curr = this; curr != nullptr; curr = curr->base) {
+      v += curr->version;
+    }
+    return v;
+  }
+  std::size_t World::chainKeysVersion() const {
+    std::size_t v = 0;
+    for (const World *curr = this; curr != nullptr; curr = curr->base) {
+      v += curr->keysVersion;
+    }
+    return v;
+  }
+  bool World::atTopLevel() const {
+    for (const World *curr = this; curr != nullptr; curr = curr->base) {
+      SearchState& st = curr->state();
+      if (!st.stepsTaken.empty() || !st.tableStack.empty()) {
+        return false;
+      }
+    }
+    return true;
+  }
+  void World::freezeLayers() {
+    for (World *curr = this; curr != nullptr; curr = curr->base) {
+      curr->data.freeze();
+    }
+  }
+  ShapeStats World::estimate(const ValPtr& p) const {
+    Shape shape = Shape::of(p);
+    ShapeStats res;
+    for (const World *curr = this; curr != nullptr; curr = curr->base) {
+      ShapeStats layer = curr->data.statsFor(shape);
+      res.ground += layer.ground;
+      res.quantified += layer.quantified;
+    }
+    return res;
+  }
+  void World::setTabling(bool on) {
+    this->tabling = on;
+    this->state().tables.clear();
+    // Tabled and untabled search can prove different things, so results
+    // cached under the other mode must not be reused
+    ++this->version;
+  }
+  bool World::isTabling() const {
+    return this->tabling;
+  }
+  void World::setOrParallel(bool on) {
+    this->orParallel = on;
+  }
+  bool World::isOrParallel() const {
+    return this->orParallel;
+  }
+  // Drops whatever may point into an arena that has gone away: the tables
+  // and the eval cache entries persistCaches() has not moved out yet
+  void World::clearCaches() {
+    SearchState& st = this->state();
+    st.tables.clear();
+    // Shape heads may belong to the arena being reset
+    st.layersByShape.clear();
+    for (auto entry = st.evalCache.begin(); entry != st.evalCache.end();) {
+      if (entry->persisted) {
+        ++entry;
+        continue;
+      }
+      auto range = st.evalIndex.equal_range(entry->hash);
+      for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == entry) {
+          st.evalIndex.erase(it);
+          break;
+        }
+      }
+      entry = st.evalCache.erase(entry);
+    }
+  }
+  // Copies cached results into the global arena, so later lines can hit
+  // them once the current arena is gone. Done when a line ends rather than
+  // on every store, since persisted terms no longer match the line's own.
+  void World::persistCaches() {
+    UseArena useGlobalArena(Arena::global());
+    for (EvalEntry& entry : this->state().evalCache) {
+      if (entry.persisted) {
+        continue;
+      }
+      entry.term = persist(entry.term);
+      for (ValSet& binding : entry.bindings) {
+        binding = persist(binding);
+      }
+      entry.vals = persist(entry.vals);
+      entry.persisted = true;
+    }
+  }
+  std::size_t evalKeyHash(const ValPtr& term, const Scope& s) {
+    std::size_t h = term->hash();
+    for (const SymId& refId : term->freeRefs) {
+      h = hashMix(h, valSetHash(s.get(refId)));
+    }
+    return h;
+  }
+  const std::size_t World::EVAL_CACHE_CAPACITY;
+  bool World::cachedEval(const ValPtr& term, const Scope& s, ValSet& out) {
+    SearchState& st = this->state();
+    std::size_t h = evalKeyHash(term, s);
+    auto range = st.evalIndex.equal_range(h);
+    for (auto it = range.first; it != range.second; ++it) {
+      EvalEntry& entry = *it->second;
+      if (entry.term != term || entry.version != this->chainVersion()) {
+        continue;
+      }
+      bool same = true;
+      for (std::size_t i = 0; same && i < term->freeRefs.size(); ++i) {
+        same = entry.bindings[i] == s.get(term->freeRefs[i]);
+      }
+      if (same) {
+        if (!entry.pure) {
+          ++worldConsultations;
+        }
+        st.evalCache.splice(st.evalCache.begin(), st.evalCache, it->second);
+        out = entry.vals;
+        ++this->evalHits;
+        return true;
+      }
+    }
+    ++this->evalMisses;
+    return false;
+  }
+  void World::cacheEval(const ValPtr& term, const Scope& s, const ValSet& vals, bool pure) {
+    SearchState& st = this->state();
+    // Results that consulted the world are only final outside proof search
+    if (!pure && (this->getNumStepsTaken() > 0 || !st.tableStack.empty())) {
+      return;
+    }
+    EvalEntry entry;
+    entry.term = term;
+    for (const SymId& refId : term->freeRefs) {
+      entry.bindings.push_back(s.get(refId));
+    }
+    entry.vals = vals;
+    entry.hash = evalKeyHash(term, s);
+    entry.version = this->chainVersion();
+    entry.pure = pure;
+    entry.persisted = false;
+    st.evalCache.push_front(std::move(entry));
+    st.evalIndex.insert(std::make_pair(st.evalCache.front().hash, st.evalCache.begin()));
+    if (st.evalCache.size() > EVAL_CACHE_CAPACITY) {
+      auto last = std::prev(st.evalCache.end());
+      auto range = st.evalIndex.equal_range(last->hash);
+      for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == last) {
+          st.evalIndex.erase(it);
+          break;
+        }
+      }
+      st.evalCache.pop_back();
+      ++this->evalEvictions;
+    }
+  }
+  World::EvalCacheStats World::evalCacheStats() const {
+    return EvalCacheStats{this->evalHits, this->evalMisses, this->evalEvictions};
+  }
+  const std::vector<World *>& World::relevantLayers(const ValPtr& first) {
+    SearchState& st = this->state();
+    std::size_t keysVersion = this->chainKeysVersion();
+    if (st.layersVersion != keysVersion) {
+      st.layersVersion = keysVersion;
+      st.layers.clear();
+      st.layersByShape.clear();
+      for (World *curr = this; curr != nullptr; curr = curr->base) {
+        if (!curr->data.empty()) {
+          st.layers.push_back(curr);
+        }
+      }
+    }
+    if (!first) {
+      return st.layers;
+    }
+    Shape shape = Shape::of(first);
+    if (!shape.head) {
+      return st.layers;
+    }
+    auto found = st.layersByShape.find(shape);
+    if (found != st.layersByShape.end()) {
+      return found->second;
+    }
+    std::vector<World *>& relevant = st.layersByShape[shape];
+    for (World *curr : st.layers) {
+      if (curr->data.mayMatchShape(shape)) {
+        relevant.push_back(curr);
+      }
+    }
+    return relevant;
+  }
+  const std::size_t World::NO_LIMIT;
+  std::vector<std::pair<ValPtr, Scope>> World::get_matches(ValPtr &p, std::size_t limit) {
+    ++worldConsultations;
+    if (this->tabling) {
+      return this->tabled(p, limit);
+    }
+    return this->search(p, limit);
+  }
+  std::vector<std::pair<ValPtr, Scope>> World::tabled(ValPtr &p, std::size_t limit) {
+    SearchState& st = this->state();
+    if (st.tableStack.empty() && st.tablesVersion != this->chainVersion()) {
+      st.tables.clear();
+      st.tablesVersion = this->chainVersion();
+    }
+    TableEntry& entry = st.tables[p];
+    if (entry.evaluating) {
+      entry.consumed = true;
+      TableEntry& caller = st.tables[st.tableStack.back()];
+      caller.lowLink = std::min(caller.lowLink, entry.depth);
+    } else if (!entry.complete) {
+      entry.depth = st.tableStack.size();
+      st.tableStack.push_back(p);
+      while (true) {
+        entry.evaluating = true;
+        entry.consumed = false;
+        entry.lowLink = entry.depth;
+        std::size_t answersBefore = st.answerCount;
+        for (std::pair<ValPtr, Scope>& answer : this->search(p, NO_LIMIT)) {
+          std::size_t h = hashMix(answer.first->hash(), answer.second.hash());
+          bool seen = false;
+          auto range = entry.answerIndex.equal_range(h);
+          for (auto it = range.first; it != range.second && !seen; ++it) {
+            const std::pair<ValPtr, Scope>& prev = entry.answers[it->second];
+            seen = prev.first == answer.first && prev.second == answer.second;
+          }
+          if (!seen) {
+            entry.answerIndex.insert(std::pair<std::size_t, std::size_t>(h, entry.answers.size()));
+            entry.answers.push_back(answer);
+            ++st.answerCount;
+          }
+        }
+        entry.evaluating = false;
+        if (entry.lowLink < entry.depth) {
+          TableEntry& caller = st.tables[st.tableStack[entry.depth - 1]];
+          caller.lowLink = std::min(caller.lowLink, entry.lowLink);
+          caller.consumed = caller.consumed || entry.consumed;
+          caller.members.push_back(p);
+          caller.members.insert(caller.members.end(), entry.members.begin(), entry.members.end());
+          entry.members.clear();
+          break;
+        }
+        if (!entry.consumed || st.answerCount == answersBefore) {
+          entry.complete = true;
+          for (const ValPtr& member : entry.members) {
+            st.tables[member].complete = true;
+          }
+          entry.members.clear();
+          break;
+        }
+      }
+      st.tableStack.pop_back();
+    }
+    if (entry.answers.size() <= limit) {
+      return entry.answers;
+    }
+    return std::vector<std::pair<ValPtr, Scope>>(entry.answers.begin(), entry.answers.begin() + limit);
+  }
+  std::vector<World::Lookup> World::lookups(ValPtr &p) {
+    std::vector<Lookup> res(1);
+    p->flatten(res[0].path);
+    res[0].layers = this->relevantLayers(res[0].path[0]);
+    // Rules whose head only matches the goal as a whole
+    if (res[0].path.size() > 1) {
+      res.push_back(Lookup{this->relevantLayers(p), std::vector<ValPtr>({p})});
+    } else if (p->hasRefs()) {
+      res.push_back(Lookup{this->relevantLayers(ValPtr()), std::vector<ValPtr>()});
+    }
+    return res;
+  }
+  MatchStreamPtr World::streamLayer(const ValPtr& p, const std::vector<ValPtr>& path, std::size_t limit) {
+    if (path.empty()) {
+      return this->data.stream_matches_whole_val(p, *this, limit);
+    }
+    return this->data.stream_matches(p, path, *this, limit);
+  }
+  std::vector<std::pair<ValPtr, Scope>> World::search(ValPtr &p, std::size_t limit) {
+    std::vector<std::pair<ValPtr, Scope>> res;
+    for (const Lookup& lookup : this->lookups(p)) {
+      this->searchLayers(p, lookup, res, limit);
+    }
+    return res;
+  }
+  // Matches are pulled one at a time, so a caller that stops early skips
+  // the rest of the search. Tabled and OR-parallel searches settle their
+  // matches together, so those hand back a finished list.
+  MatchStreamPtr World::stream_matches(ValPtr &p) {
+    if (this->tabling || canOrFork(*this)) {
+      return MatchStreamPtr(new MatchListStream(this->get_matches(p)));
+    }
+    ++worldConsultations;
+    std::vector<std::function<MatchStreamPtr(std::size_t)>> sources;
+    for (const Lookup& lookup : this->lookups(p)) {
+      for (World *curr : lookup.layers) {
+        sources.push_back([curr, p, path = lookup.path](std::size_t limit) {
+          return curr->streamLayer(p, path, limit);
+        });
+      }
+    }
+    return MatchStreamPtr(new MatchChain(std::move(sources), NO_LIMIT));
+  }
+  std::vector<std::vector<std::pair<ValPtr, Scope>>> World::get_matches_batch(std::vector<ValPtr>& goals, std::size_t limit) {
+    worldConsultations += goals.size();
+    std::vector<std::vector<std::pair<ValPtr, Scope>>> res;
+    if (this->tabling) {
+      for (ValPtr& goal : goals) {
+        res.push_back(this->tabled(goal, limit));
+      }
+      return res;
+    }
+    std::vector<BatchGoal> batch(goals.size());
+    std::vector<std::vector<Lookup>> goalLookups;
+    for (std::size_t i = 0; i < goals.size(); ++i) {
+      goalLookups.push_back(this->lookups(goals[i]));
+      batch[i].val = goals[i];
+      batch[i].flat = goalLookups[i][0].path;
+      batch[i].limit = limit;
+    }
+    // Layers are visited in chain order, which every goal's relevant
+    // layers follow, so each goal's answers come out in search() order
+    for (World *curr = this; curr != nullptr; curr = curr->base) {
+      std::vector<BatchGoal *> group;
+      for (std::size_t i = 0; i < goals.size(); ++i) {
+        const std::vector<World *>& relevant = goalLookups[i][0].layers;
+        if (std::find(relevant.begin(), relevant.end(), curr) != relevant.end()) {
+          group.push_back(&batch[i]);
+        }
+      }
+      if (!group.empty()) {
+        curr->data.get_matches_batch(group, *curr);
+      }
+    }
+    for (std::size_t i = 0; i < goals.size(); ++i) {
+      for (std::size_t j = 1; j < goalLookups[i].size(); ++j) {
+        this->searchLayers(batch[i].val, goalLookups[i][j], batch[i].out, batch[i].limit);
+      }
+      res.push_back(std::move(batch[i].out));
+    }
+    return res;
+  }
+  // In OR-parallel mode each layer is searched as its own task. Matching
+  // only binds existing values, so answers need no adopting.
+  void World::searchLayers(ValPtr &p, const Lookup& lookup, std::vector<std::pair<ValPtr, Scope>>& res, std::size_t limit) {
+    const std::vector<World *>& layers = lookup.layers;
+    if (layers.size() < 2 || res.size() >= limit || !canOrFork(*this)) {
+      for (World *curr : layers) {
+        if (res.size() >= limit || cancelled()) {
+          return;
+        }
+        MatchStreamPtr matches = curr->streamLayer(p, lookup.path, limit - res.size());
+        drain(*matches, res, limit);
+      }
+      return;
+    }
+    this->freezeLayers();
+    Steps steps(*this);
+    Arena& outer = Arena::current();
+    CancelToken token{{false}, cancelToken};
+    std::size_t wanted = limit - res.size();
+    std::vector<std::vector<std::pair<ValPtr, Scope>>> outs(layers.size());
+    std::vector<std::function<void()>> tasks;
+    for (std::size_t i = 0; i < layers.size(); ++i) {
+      tasks.push_back([&p, &lookup, &steps, &outer, &token, &outs, wanted, i]() {
+        if (token.cancelled) {
+          return;
+        }
+        Arena arena(&outer);
+        UseArena use(arena);
+        World::Task task(steps);
+        UseCancelToken useToken(&token);
+        MatchStreamPtr matches = lookup.layers[i]->streamLayer(p, lookup.path, wanted);
+        drain(*matches, outs[i], wanted);
+        if (outs[i].size() >= wanted) {
+          token.cancelled = true;
+        }
+      });
+    }
+    WorkPool::instance()->run(tasks);
+    for (const std::vector<std::pair<ValPtr, Scope>>& out : outs) {
+      for (const std::pair<ValPtr, Scope>& match : out) {
+        if (res.size() >= limit) {
+          return;
+        }
+        res.push_back(match);
+      }
+    }
+  }
+  bool World::holds(ValPtr &p) {
+    return this->get_matches(p, 1).size() > 0;
+  }
+  std::vector<bool> World::holdsBatch(std::vector<ValPtr>& goals) {
+    std::vector<bool> res;
+    for (const std::vector<std::pair<ValPtr, Scope>>& matches : this->get_matches_batch(goals, 1)) {
+      res.push_back(!matches.empty());
+    }
+    return res;
+  }
+  // Only earlier uses of next's decl in the newer half of the stack can
+  // start a repeat, and each costs one hash comparison. That is still linear
+  // when one rule is used at every level of a deep proof. A hash hit is
+  // compared step by step and then confirmed by the O(n) scan, which then
+  // almost always rejects the step.
+  bool World::isLegal(const CheckStep& next) const {
+    SearchState& st = this->state();
+    if (this->tabling) {
+      return true;
+    }
+    auto found = st.stepPositions.find(next.chosenDecl.get());
+    if (found == st.stepPositions.end()) {
+      return true;
+    }
+    std::size_t n = st.stepsTaken.size();
+    std::uint64_t nextHash = next.chosenDecl->hash();
+    for (auto it = found->second.rbegin(); it != found->second.rend(); ++it) {
+      std::size_t q = *it;
+      std::size_t len = n - q;
+      if (2*len > n + 1) {
+        break;
+      }
+      std::size_t first = q + 1 - len;
+      if (this->stepRangeHash(first, q + 1) != this->stepRangeHash(q + 1, n) * STEP_HASH_BASE + nextHash) {
+        continue;
+      }
+      bool repeated = true;
+      for (std::size_t i = 0; i + 1 < len && repeated; ++i) {
+        repeated = st.stepsTaken[first + i] == st.stepsTaken[q + 1 + i];
+      }
+      if (repeated) {
+        return !this->hasRepeatedStepSeq(next);
+      }
+    }
+    return true;
+  }
+  // The exact rule isLegal applies: scanning back from next, a greedy match
+  // against the newest steps that is not restarted at the step breaking it.
+  // Any repeat it finds is also found by the hash check above, so it only
+  // runs to confirm one.
+  bool World::hasRepeatedStepSeq(const CheckStep& next) const {
+    const std::vector<CheckStep>& steps = this->state().stepsTaken;
+    std::size_t matched = 0;
+    for (std::size_t i = 1; i <= steps.size(); ++i) {
+      const CheckStep& expected = matched == 0 ? next : steps[steps.size() - matched];
+      if (steps[steps.size() - i] == expected) {
+        ++matched;
+        if (2*matched == i + 1) {
+          return true;
+        }
+      } else {
+        matched = 0;
+      }
+    }
+    return false;
+  }
+  void World::pushStep(const CheckStep& step) {
+    SearchState& st = this->state();
+    st.stepPositions[step.chosenDecl.get()].push_back(st.stepsTaken.size());
+    st.stepHashes.push_back(st.stepHashes.back() * STEP_HASH_BASE + step.chosenDecl->hash());
+    st.stepPowers.push_back(st.stepPowers.back() * STEP_HASH_BASE);
+    st.stepsTaken.push_back(step);
+  }
+  void World::popStep() {
+    SearchState& st = this->state();
+    std::vector<std::size_t>& positions = st.stepPositions[st.stepsTaken.back().chosenDecl.get()];
+    positions.pop_back();
+    if (positions.empty()) {
+      st.stepPositions.erase(st.stepsTaken.back().chosenDecl.get());
+    }
+    st.stepHashes.pop_back();
+    st.stepPowers.pop_back();
+    st.stepsTaken.pop_back();
+  }
+
+  std::size_t InternHash::operator()(const Value *v) const {
+    return v->hash();
+  }
+
+  bool InternEqual::operator()(const Value *v1, const Value *v2) const {
+    return v1->kind == v2->kind && *v1 == *v2;
+  }
+
+  const std::size_t Arena::BLOCK_SIZE;
+  const std::size_t Arena::ALIGN;
+  thread_local Arena *Arena::active(nullptr);
+  Arena::Arena() : used{0}, outer{nullptr} {}
+  Arena::Arena(const Arena *outer) : used{0}, outer{outer} {}
+  Arena::~Arena() {
+    for (Value *val : this->values) {
+      val->~Value();
+    }
+    for (char *block : this->blocks) {
+      delete[] block;
+    }
+  }
+  void *Arena::allocate(std::size_t size) {
+    size = (size + ALIGN - 1) & ~(ALIGN - 1);
+    if (this->blocks.empty() || this->used + size > BLOCK_SIZE) {
+      this->blocks.push_back(new char[std::max(BLOCK_SIZE, size)]);
+      this->used = 0;
+    }
+    void *p = this->blocks.back() + this->used;
+    this->used += size;
+    return p;
+  }
+  void Arena::release(void *p, std::size_t size) {
+    size = (size + ALIGN - 1) & ~(ALIGN - 1);
+    if (!this->blocks.empty() && this->used >= size && this->blocks.back() + this->used - size == p) {
+      this->used -= size;
+    }
+  }
+  Arena& Arena::global() {
+    static Arena arena;
+    return arena;
+  }
+  Arena& Arena::current() {
+    return active ? *active : global();
+  }
+
+  UseArena::UseArena(Arena& arena) : prev{Arena::active} {
+    Arena::active = &arena;
+  }
+  UseArena::~UseArena() {
+    Arena::active = this->prev;
+  }
+
+  void *Value::operator new(std::size_t size) {
+    return Arena::current().allocate(size);
+  }
+  void Value::operator delete(void *p, std::size_t size) {
+    Arena::current().release(p, size);
+  }
+
+  ValPtr bundle(Value *val) {
+    Arena& global = Arena::global();
+    Arena& curr = Arena::current();
+    InternTable::iterator it = global.interned.find(val);
+    if (it != global.interned.end()) {
+      delete val;
+      return (*it)->self();
+    }
+    for (const Arena *arena = &curr; arena != nullptr && arena != &global; arena = arena->outer) {
+      InternTable::const_iterator found = arena->interned.find(val);
+      if (found != arena->interned.end()) {
+        delete val;
+        return (*found)->self();
+      }
+    }
+    val->arena = &curr;
+    curr.values.push_back(val);
+    curr.interned.insert(val);
+    return val->self();
+  }
+
+  thread_local Arena *adoptSource(nullptr);
+  ValPtr persist(const ValPtr& p) {
+    if (adoptSource) {
+      return p->arena == adoptSource ? p->persisted() : p;
+    }
+    if (p->arena == &Arena::global()) {
       return p;
     }
+    UseArena use(Arena::global());
+    return p->persisted();
+  }
+  // Copies the parts of p that live in source into the current arena
+  ValPtr adopt(const ValPtr& p, Arena& source) {
+    Arena *prev = adoptSource;
+    adoptSource = &source;
+    ValPtr res = persist(p);
+    adoptSource = prev;
+    return res;
+  }
+
+  std::unique_ptr<WorkPool> WorkPool::pool;
+  thread_local std::size_t WorkPool::slot(0);
+  WorkPool::WorkPool(std::size_t size) : queued{0}, stopping{false} {
+    for (std::size_t i = 0; i < size; ++i) {
+      this->queues.push_back(std::unique_ptr<Queue>(new Queue()));
+    }
+    for (std::size_t i = 1; i < size; ++i) {
+      this->threads.push_back(std::thread(&WorkPool::work, this, i));
+    }
+  }
+  WorkPool::~WorkPool() {
+    {
+      std::lock_guard<std::mutex> guard(this->sleepLock);
+      this->stopping = true;
+    }
+    this->wake.notify_all();
+    for (std::thread& thread : this->threads) {
+      thread.join();
+    }
+  }
+  std::size_t WorkPool::size() const {
+    return this->queues.size();
+  }
+  bool WorkPool::runOne() {
+    // Own jobs are taken newest first, stolen ones oldest first
+    std::function<void()> job;
+    for (std::size_t i = 0; i < this->queues.size() && !job; ++i) {
+      Queue& q = *this->queues[(slot + i) % this->queues.size()];
+      std::lock_guard<std::mutex> guard(q.lock);
+      if (q.jobs.empty()) {
+        continue;
+      }
+      if (i == 0) {
+        job = std::move(q.jobs.back());
+        q.jobs.pop_back();
+      } else {
+        job = std::move(q.jobs.front());
+        q.jobs.pop_front();
+      }
+      --this->queued;
+    }
+    if (!job) {
+      return false;
+    }
+    job();
+    return true;
+  }
+  void WorkPool::work(std::size_t index) {
+    slot = index;
+    while (true) {
+      if (this->runOne()) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(this->sleepLock);
+      this->wake.wait(lock, [this]() {
+        return this->stopping || this->queued > 0;
+      });
+      if (this->stopping) {
+        return;
+      }
+    }
+  }
+  void WorkPool::run(std::vector<std::function<void()>>& jobs) {
+    std::atomic<std::size_t> remaining(jobs.size());
+    std::exception_ptr failure;
+    std::mutex failureLock;
+    // Counted before they are queued, so queued never drops below zero
+    {
+      std::lock_guard<std::mutex> guard(this->sleepLock);
+      this->queued += jobs.size();
+    }
+    {
+      Queue& home = *this->queues[slot];
+      std::lock_guard<std::mutex> guard(home.lock);
+      for (std::function<void()>& job : jobs) {
+        home.jobs.push_back([this, &job, &remaining, &failure, &failureLock]() {
+          try {
+            job();
+          } catch (...) {
+            std::lock_guard<std::mutex> guard(failureLock);
+            if (!failure) {
+              failure = std::current_exception();
+            }
+          }
+          if (--remaining == 0) {
+            // The run may return as soon as it sees zero, so only the pool
+            // is touched from here. Taking the lock keeps the wakeup from
+            // slipping in between its check and its wait.
+            std::lock_guard<std::mutex> guard(this->sleepLock);
+            this->wake.notify_all();
+          }
+        });
+      }
+    }
+    this->wake.notify_all();
+    // Help out rather than block, so nested runs cannot starve the pool,
+    // and sleep while every job left is already being run elsewhere
+    while (remaining > 0) {
+      if (this->runOne()) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(this->sleepLock);
+      this->wake.wait(lock, [this, &remaining]() {
+        return remaining == 0 || this->queued > 0;
+      });
+    }
+    if (failure) {
+      std::rethrow_exception(failure);
+    }
   }
-  ValPtr extractApply(const ValPtr& p) {
-    if (const Lambda *l = dynamic_cast<const Lambda *>(p.get())) {
-      return extractApply(l->body);
-    } else if (const Declare *d = dynamic_cast<const Declare *>(p.get())) {
-      return extractApply(d->body);
-    } else if (const Constrain *c = dynamic_cast<const Constrain *>(p.get())) {
-      return extractApply(c->body);
-    } else {
-      return p;
+  void WorkPool::configure(std::size_t size) {
+    pool.reset();
+    if (size > 1) {
+      pool.reset(new WorkPool(size));
     }
   }
-  Value& getVal(const ValPtr& vp) {
-    return *vp;
+  WorkPool *WorkPool::instance() {
+    return pool.get();
   }
-  std::unordered_set<SymId> getRefIds(const ValPtr& vp) {
-    std::unordered_set<SymId> refIds;
-    vp->collectRefIds(refIds);
-    return refIds;
+
+  ValSet persist(const ValSet& vs) {
+    ValSet res(vs.bucket_count());
+    for (const ValPtr& val : vs) {
+      res.insert(persist(val));
+    }
+    return res;
   }
-  void ValTable::add(const ValPtr& p) {
-    std::vector<ValPtr> v;
-    ValPtr p2 = stripLambdas(p);
-    extractApply(p2)->flatten(v);
-    this->add_(v.begin(), v.end(), p2);
+
+  RefIds mergeRefIds(const RefIds& a, const RefIds& b) {
+    RefIds res;
+    res.reserve(a.size() + b.size());
+    std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(res));
+    return res;
   }
-  void ValTable::get_matches_whole_val(const ValPtr& val, Scope a, Scope b, World& w, std::vector<std::pair<ValPtr, Scope>>& out) {
-    for (const std::pair<const ValPtr, ValPtr>& leaf : this->leaves) {
-      CheckStep next = CheckStep(val, leaf.second);
-      if (w.isLegal(next)) {
-        w.pushStep(next);
-        Scope a2(&a);
-        if (val->match(leaf.first, a2) && leaf.second->eval(b, w).size() > 0) {
-          out.push_back(std::pair<ValPtr, Scope>{leaf.second, a2.squash()});
-        }
-        w.popStep();
+
+  RefIds removeRefId(const RefIds& refIds, const SymId& refId) {
+    RefIds res;
+    res.reserve(refIds.size());
+    std::remove_copy(refIds.begin(), refIds.end(), std::back_inserter(res), refId);
+    return res;
+  }
+
+  bool Value::closedIn(const Scope& s) const {
+    for (const SymId& refId : this->freeRefs) {
+      if (!s.has(refId)) {
+        return false;
       }
     }
-    for (const std::pair<const ValPtr, ValPtr>& leaf : this->quantified_leaves) {
-      CheckStep next = CheckStep(val, leaf.second);
-      if (w.isLegal(next)) {
-        w.pushStep(next);
-        Scope b2(&b);
-        if (leaf.first->match(val, b2) && leaf.second->eval(b2, w).size() > 0) {
-          out.push_back(std::pair<ValPtr, Scope>{leaf.second, a.squash()});
-        }
-        w.popStep();
+    return true;
+  }
+  bool Value::refsBoundIn(const Scope& s) const {
+    for (const SymId& refId : this->freeRefs) {
+      if (s.has(refId)) {
+        return true;
       }
     }
-    for (const std::pair<const ValPtr, std::shared_ptr<ValTable>>& branch : this->branches) {
-      branch.second->get_matches_whole_val(val, a, b, w, out);
-    }
-    for (const std::pair<const ValPtr, std::shared_ptr<ValTable>>& branch : this->quantified_branches) {
-      branch.second->get_matches_whole_val(val, a, b, w, out);
-    }
-  }
-  void ValTable::get_matches(const ValPtr& val, std::vector<ValPtr>::iterator it, std::vector<ValPtr>::iterator end, Scope a, Scope b, World& w, std::vector<std::pair<ValPtr, Scope>>& out) {
-    std::size_t numRefs = getRefIds(*it).size();
-    if (it+1 == end) {
-      bool exactMatched = false;
-      if (numRefs == 0 && this->leaves.count(*it)) {
-        CheckStep next = CheckStep(val, this->leaves[*it]);
-        if (w.isLegal(next)) {
-          w.pushStep(next);
-          if (this->leaves[*it]->eval(b, w).size() > 0) {
-            exactMatched = true;
-            out.push_back(std::pair<ValPtr, Scope>{this->leaves[*it], a.squash()});
-          }
-          w.popStep();
-        }
-      }
-      if (!exactMatched && numRefs > 0) {
-        for (const std::pair<const ValPtr, ValPtr>& leaf : this->leaves) {
-          CheckStep next = CheckStep(val, leaf.second);
-          if (w.isLegal(next)) {
-            w.pushStep(next);
-            Scope a2(&a);
-            if ((*it)->match(leaf.first, a2) && leaf.second->eval(b, w).size() > 0) {
-              out.push_back(std::pair<ValPtr, Scope>{leaf.second, a2.squash()});
-            }
-            w.popStep();
-          }
-        }
-      }
-      for (const std::pair<const ValPtr, ValPtr>& leaf : this->quantified_leaves) {
-        CheckStep next = CheckStep(val, leaf.second);
-        if (w.isLegal(next)) {
-          w.pushStep(next);
-          Scope b2(&b);
-          if (leaf.first->match(*it, b2) && leaf.second->eval(b2, w).size() > 0) {
-            out.push_back(std::pair<ValPtr, Scope>{leaf.second, a.squash()});
-          }
-          w.popStep();
-        }
-      }
-    } else {
-      if (numRefs == 0 && this->branches.count(*it)) {
-        this->branches[*it]->get_matches(val, it+1, end, a, b, w, out);
-      } else if (numRefs > 0) {
-        for (const std::pair<const ValPtr, std::shared_ptr<ValTable>>& branch : this->branches) {
-          Scope a2(&a);
-          if ((*it)->match(branch.first, a2)) {
-            branch.second->get_matches(val, it+1, end, a2, b, w, out);
-          }
-        }
+    return false;
+  }
+
+  bool bindsAnyOf(const Value *v, const std::vector<SymId>& binders) {
+    for (const SymId& binder : binders) {
+      if (std::binary_search(v->freeRefs.begin(), v->freeRefs.end(), binder)) {
+        return true;
       }
-      for (const std::pair<const ValPtr, std::shared_ptr<ValTable>>& branch : this->quantified_branches) {
-        Scope b2(&b);
-        if (branch.first->match(*it, b2)) {
-          branch.second->get_matches(val, it+1, end, a, b2, w, out);
+    }
+    return false;
+  }
+
+  std::size_t alphaHash(const Value *v, std::vector<SymId>& binders) {
+    if (!bindsAnyOf(v, binders)) {
+      return v->hash();
+    }
+    switch (v->kind) {
+    case Kind::REF: {
+      const Ref *r = static_cast<const Ref *>(v);
+      for (std::size_t i = binders.size(); i > 0; --i) {
+        if (binders[i - 1] == r->ref_id) {
+          return hashMix(BOUND_REF_SEED, binders.size() - i);
         }
       }
+      return v->hash();
+    }
+    case Kind::LAMBDA: {
+      const Lambda *l = static_cast<const Lambda *>(v);
+      binders.push_back(l->arg_id);
+      std::size_t h = hashMix(hashMix(LAMBDA_SEED, l->arg_name), alphaHash(l->body.get(), binders));
+      binders.pop_back();
+      return h;
+    }
+    case Kind::APPLY: {
+      const Apply *a = static_cast<const Apply *>(v);
+      return hashMix(hashMix(APPLY_SEED, alphaHash(a->pred.get(), binders)), alphaHash(a->arg.get(), binders));
+    }
+    case Kind::DECLARE: {
+      const Declare *d = static_cast<const Declare *>(v);
+      return hashMix(hashMix(DECLARE_SEED, alphaHash(d->with.get(), binders)), alphaHash(d->body.get(), binders));
+    }
+    case Kind::CONSTRAIN: {
+      const Constrain *c = static_cast<const Constrain *>(v);
+      return hashMix(hashMix(CONSTRAIN_SEED, alphaHash(c->constraint.get(), binders)), alphaHash(c->body.get(), binders));
+    }
+    default:
+      return v->hash();
     }
   }
 
-  CheckStep::CheckStep(const ValPtr& goal, const ValPtr& chosenDecl) : goal(goal), chosenDecl(chosenDecl) {}
-  bool CheckStep::operator==(const CheckStep& other) const {
-    //return (*other.goal) == (*this->goal) && other.chosenDecl.get() == this->chosenDecl.get();
-    return other.chosenDecl.get() == this->chosenDecl.get();
+  std::size_t lambdaHash(const SymId& arg_id, const SymId& arg_name, const ValPtr& body) {
+    std::vector<SymId> binders({arg_id});
+    return hashMix(hashMix(LAMBDA_SEED, arg_name), alphaHash(body.get(), binders));
   }
 
-  std::size_t World::getNumStepsTaken() const {
-    return this->stepsTaken.size();
-  }
-  bool World::hasRepeatedStepSeq(std::vector<CheckStep>& seen, std::vector<CheckStep>& currMatch, std::size_t cutoff) const {
-    if (seen.size() >= cutoff) {
+  bool alphaEqual(const Value *a, const Value *b, std::vector<std::pair<SymId, SymId>>& binders) {
+    if (a->kind != b->kind) {
       return false;
     }
-    for (std::size_t i = 1; i <= this->stepsTaken.size(); ++i) {
-      const CheckStep& curr = this->stepsTaken[this->stepsTaken.size() - i];
-      seen.push_back(curr);
-      if (seen.size() > 1) {
-        if (curr == seen[currMatch.size()]) {
-          currMatch.push_back(curr);
-          if (currMatch.size()*2 == seen.size()) {
-            return true;
-          }
-        } else {
-          currMatch.clear();
+    if (a == b) {
+      bool bound = false;
+      for (const std::pair<SymId, SymId>& binder : binders) {
+        if (std::binary_search(a->freeRefs.begin(), a->freeRefs.end(), binder.first)
+            || std::binary_search(a->freeRefs.begin(), a->freeRefs.end(), binder.second)) {
+          bound = true;
+          break;
         }
       }
+      if (!bound) {
+        return true;
+      }
     }
-    if (this->base != nullptr) {
-      return this->base->hasRepeatedStepSeq(seen, currMatch, cutoff);
-    } else {
-      return false;
-    }
-  }
-  World::World() : base{nullptr}, numPrevSteps{0} {}
-  World::World(World *base) : base{base}, numPrevSteps{base ? base->getNumStepsTaken() : 0} {}
-  void World::add(const ValPtr& p) {
-    this->data.add(p);
-  }
-  std::vector<std::pair<ValPtr, Scope>> World::get_matches(ValPtr &p) {
-    std::vector<ValPtr> flat;
-    p->flatten(flat);
-    std::vector<std::pair<ValPtr, Scope>> res;
-    for (World *curr = this; curr != nullptr; curr = curr->base) {
-      curr->data.get_matches(p, flat.begin(), flat.end(), Scope(), Scope(), *curr, res);
-    }
-    if (flat.size() > 1) {
-      std::vector<ValPtr> single({p});
-      for (World *curr = this; curr != nullptr; curr = curr->base) {
-        curr->data.get_matches(p, single.begin(), single.end(), Scope(), Scope(), *curr, res);
+    switch (a->kind) {
+    case Kind::REF: {
+      const Ref *refA = static_cast<const Ref *>(a);
+      const Ref *refB = static_cast<const Ref *>(b);
+      const SymId& ra = refA->ref_id;
+      const SymId& rb = refB->ref_id;
+      for (std::size_t i = binders.size(); i > 0; --i) {
+        if (binders[i - 1].first == ra || binders[i - 1].second == rb) {
+          return binders[i - 1].first == ra && binders[i - 1].second == rb && refA->name == refB->name;
+        }
       }
-    } else if (getRefIds(p).size() > 0) {
-      for (World *curr = this; curr != nullptr; curr = curr->base) {
-        curr->data.get_matches_whole_val(p, Scope(), Scope(), *curr, res);
+      return ra == rb;
+    }
+    case Kind::LAMBDA: {
+      const Lambda *la = static_cast<const Lambda *>(a);
+      const Lambda *lb = static_cast<const Lambda *>(b);
+      if (la->arg_name != lb->arg_name) {
+        return false;
       }
+      binders.push_back(std::pair<SymId, SymId>(la->arg_id, lb->arg_id));
+      bool eq = alphaEqual(la->body.get(), lb->body.get(), binders);
+      binders.pop_back();
+      return eq;
+    }
+    case Kind::APPLY: {
+      const Apply *aa = static_cast<const Apply *>(a);
+      const Apply *ab = static_cast<const Apply *>(b);
+      return alphaEqual(aa->pred.get(), ab->pred.get(), binders) && alphaEqual(aa->arg.get(), ab->arg.get(), binders);
+    }
+    case Kind::DECLARE: {
+      const Declare *da = static_cast<const Declare *>(a);
+      const Declare *db = static_cast<const Declare *>(b);
+      return alphaEqual(da->with.get(), db->with.get(), binders) && alphaEqual(da->body.get(), db->body.get(), binders);
+    }
+    case Kind::CONSTRAIN: {
+      const Constrain *ca = static_cast<const Constrain *>(a);
+      const Constrain *cb = static_cast<const Constrain *>(b);
+      return alphaEqual(ca->constraint.get(), cb->constraint.get(), binders) && alphaEqual(ca->body.get(), cb->body.get(), binders);
+    }
+    default:
+      return a == b;
     }
-    return res;
-  }
-  bool World::isLegal(const CheckStep& next) const {
-    std::vector<CheckStep> seen({next});
-    std::vector<CheckStep> match;
-    return !this->hasRepeatedStepSeq(seen, match, (this->getNumStepsTaken() + 1) / 2 + 1);
-  }
-  void World::pushStep(const CheckStep& step) {
-    this->stepsTaken.push_back(step);
-  }
-  void World::popStep() {
-    this->stepsTaken.pop_back();
   }
 
-  ValPtr bundle(Value *val) {
-    ValPtr p(val);
-    val->self = ValPtrWeak(p);
-    return p;
+  ValStreamPtr Value::stream(Scope& s, World& w) {
+    return ValStreamPtr(new SetStream(this->eval(s, w)));
   }
-
   std::string Value::repr_str() const {
     std::stringstream sstr;
     this->repr(sstr);
     return sstr.str();
   }
 
-  Sym::Sym(const SymId &sym_id) : sym_id(sym_id) {}
+  Sym::Sym(const SymId &sym_id) : Value(KIND, hashMix(SYM_SEED, sym_id)), sym_id(sym_id) {}
   void Sym::repr(std::ostream& o) const {
-    o << this->sym_id;
+    o << symName(this->sym_id);
   }
   ValSet Sym::subst(Scope& s) {
-    return ValSet({this->self.lock()}, 1);
+    return ValSet({this->self()}, 1);
   }
   bool Sym::operator==(const Value& other) const {
-    if (const Sym *s = dynamic_cast<const Sym *>(&other)) {
+    if (const Sym *s = valCast<Sym>(&other)) {
       if (this->sym_id == s->sym_id) {
         return true;
       }
     }
     return false;
   }
-  std::size_t Sym::hash() const {
-    return 85831957 ^ std::hash<std::string>{}(this->sym_id);
+  ValPtr Sym::persisted() const {
+    return bundle(new Sym(this->sym_id));
   }
   
-  Wildcard::Wildcard() {}
+  Wildcard::Wildcard() : Value(KIND, hashMix(WILDCARD_SEED, 0)) {}
   void Wildcard::repr(std::ostream& o) const {
     o << '*';
   }
   ValSet Wildcard::subst(Scope& s) {
-    return ValSet({this->self.lock()}, 1);
+    return ValSet({this->self()}, 1);
   }
   bool Wildcard::operator==(const Value& other) const {
-    if (const Wildcard *s = dynamic_cast<const Wildcard *>(&other)) {
-      return true;
-    }
-    return false;
+    return other.kind == KIND;
   }
-  std::size_t Wildcard::hash() const {
-    return 12952153;
+  ValPtr Wildcard::persisted() const {
+    return INSTANCE;
   }
 
   ValPtr Wildcard::INSTANCE(bundle(new Wildcard()));
   
-  Ref::Ref(const SymId& ref_id) : ref_id(ref_id) {}
+  Ref::Ref(const SymId& ref_id) : Ref(ref_id, ref_id) {}
+  Ref::Ref(const SymId& ref_id, const SymId& name) : Value(KIND, hashMix(REF_SEED, ref_id), RefIds({ref_id})), ref_id(ref_id), name(name) {}
   void Ref::repr(std::ostream& o) const {
-    o << this->ref_id;
+    o << symName(this->name);
   }
   ValSet Ref::subst(Scope& s) {
     if (s.has(this->ref_id)) {
-      ValSet& vs = s.get(this->ref_id);
+      const ValSet& vs = s.get(this->ref_id);
       if (!vs.count(Wildcard::INSTANCE))
         return vs;
     }
-    return ValSet({this->self.lock()}, 1);
+    return ValSet({this->self()}, 1);
   }
-  bool Ref::match(const ValPtr& other, Scope& s) const {
-    if (s.has(this->ref_id)) {
-      const ValSet& vs = s.get(this->ref_id);
-      if (vs.count(other) || vs.count(Wildcard::INSTANCE)) {
-        ValSet vs2({other}, 1);
-        s.add(this->ref_id, vs2);
-        return true;
-      } else {
-        return false;
-      }
-    } else {
-      ValSet vs({other}, 1);
-      s.add(this->ref_id, vs);
-      return true;
+  bool Ref::match(const ValPtr& other, Trail& t) const {
+    ValPtr bound = t.lookup(this->ref_id);
+    if (bound && bound != other && bound != Wildcard::INSTANCE) {
+      return false;
     }
+    t.bind(this->ref_id, other);
+    return true;
   }
   bool Ref::operator==(const Value& other) const {
-    if (const Ref *s = dynamic_cast<const Ref *>(&other)) {
+    if (const Ref *s = valCast<Ref>(&other)) {
       return this->ref_id == s->ref_id;
     }
     return false;
   }
-  std::size_t Ref::hash() const {
-    return 128582195 ^ std::hash<std::string>{}(this->ref_id);
-  }
-  void Ref::collectRefIds(std::unordered_set<SymId>& s) const {
-    s.insert(this->ref_id);
+  ValPtr Ref::persisted() const {
+    return bundle(new Ref(this->ref_id, this->name));
   }
 
-  Arbitrary::Arbitrary() {}
+  Arbitrary::Arbitrary() : Value(KIND, hashMix(ARBITRARY_SEED, 0)) {}
   void Arbitrary::repr(std::ostream& o) const {
     o << '?';
   }
   ValSet Arbitrary::subst(Scope& s) {
-    return ValSet({this->self.lock()}, 1);
+    return ValSet({this->self()}, 1);
   }
   ValSet Arbitrary::eval(Scope& s, World& w) {
     return ValSet({bundle(new ArbitraryInstance())}, 1);
   }
   bool Arbitrary::operator==(const Value& other) const {
-    if (const Arbitrary *s = dynamic_cast<const Arbitrary *>(&other)) {
-      return true;
-    }
-    return false;
+    return other.kind == KIND;
   }
-  std::size_t Arbitrary::hash() const {
-    return 95318557;
+  ValPtr Arbitrary::persisted() const {
+    return INSTANCE;
   }
 
   ValPtr Arbitrary::INSTANCE(bundle(new Arbitrary()));
 
-  std::size_t ArbitraryInstance::count(0);
-  ArbitraryInstance::ArbitraryInstance() {
-    this->id = count;
-    ++count;
+  std::atomic<std::size_t> ArbitraryInstance::count(0);
+  std::size_t ArbitraryInstance::minted() {
+    return count;
   }
+  ArbitraryInstance::ArbitraryInstance() : ArbitraryInstance(count++) {}
+  ArbitraryInstance::ArbitraryInstance(std::size_t id) : Value(KIND, hashMix(ARBITRARY_INSTANCE_SEED, id)), id(id) {}
   void ArbitraryInstance::repr(std::ostream& o) const {
     o << '?' << id;
   }
   ValSet ArbitraryInstance::subst(Scope& s) {
-    return ValSet({this->self.lock()}, 1);
+    return ValSet({this->self()}, 1);
   }
   bool ArbitraryInstance::operator==(const Value& other) const {
-    if (const ArbitraryInstance *s = dynamic_cast<const ArbitraryInstance *>(&other)) {
+    if (const ArbitraryInstance *s = valCast<ArbitraryInstance>(&other)) {
       if (this->id == s->id) {
         return true;
       }
     }
     return false;
   }
-  std::size_t ArbitraryInstance::hash() const {
-    return 998439321 ^ this->id;
+  ValPtr ArbitraryInstance::persisted() const {
+    return bundle(new ArbitraryInstance(this->id));
   }
 
-  std::size_t Lambda::count(0);
-  Lambda::Lambda(const SymId& arg_id, const ValPtr& body) : arg_id(arg_id), body(body) {
-    this->id = count;
-    ++count;
-  }
+  Lambda::Lambda(const SymId& arg_id, const SymId& arg_name, const ValPtr& body) : Value(KIND, lambdaHash(arg_id, arg_name, body), removeRefId(body->freeRefs, arg_id)), arg_id(arg_id), arg_name(arg_name), body(body) {}
   void Lambda::repr(std::ostream& o) const {
-    o << '<' << this->arg_id << '>' << ' ';
+    o << '<' << symName(this->arg_name) << '>' << ' ';
     this->body->repr(o);
   }
   void Lambda::repr_closed(std::ostream& o) const {
@@ -438,52 +2176,35 @@ namespace logic {
     o << ')';
   }
   ValSet Lambda::subst(Scope& s) {
-    if (!this->savedRefIds) {
-      this->savedRefIds = std::shared_ptr<std::unordered_set<SymId>>(new std::unordered_set<SymId>());
-      this->collectRefIds(*this->savedRefIds);
-    }
-    bool disjoint = true;
-    for (const SymId& refId : *this->savedRefIds) {
-      if (s.has(refId)) {
-        disjoint = false;
-        break;
-      }
+    if (!this->refsBoundIn(s)) {
+      return ValSet({this->self()}, 1);
     }
-    if (disjoint) {
-      return ValSet({this->self.lock()}, 1);
-    }
-    Shadow sh = Shadow(&s);
-    sh.shadow(this->arg_id);
+    Scope sh(s);
+    sh.remove(this->arg_id);
     ValSet bodySubstdVals = this->body->subst(sh);
     ValSet res(bodySubstdVals.bucket_count());
     for (const ValPtr& bodySubstd : bodySubstdVals) {
-      res.insert(bundle(new Lambda(this->arg_id, bodySubstd)));
+      res.insert(bundle(new Lambda(this->arg_id, this->arg_name, bodySubstd)));
     }
     return res;
   }
   bool Lambda::operator==(const Value& other) const {
-    if (const Lambda *s = dynamic_cast<const Lambda *>(&other)) {
-      if (this->id == s->id) {
-        return true;
+    if (const Lambda *s = valCast<Lambda>(&other)) {
+      if (this->arg_name != s->arg_name) {
+        return false;
       }
+      std::vector<std::pair<SymId, SymId>> binders({{this->arg_id, s->arg_id}});
+      return alphaEqual(this->body.get(), s->body.get(), binders);
     }
     return false;
   }
-  std::size_t Lambda::hash() const {
-    return 195218521 ^ this->id;
-  }
-  void Lambda::collectRefIds(std::unordered_set<SymId>& refIds) const {
-    if (refIds.count(this->arg_id)) {
-      this->body->collectRefIds(refIds);
-    } else {
-      this->body->collectRefIds(refIds);
-      refIds.erase(this->arg_id);
-    }
+  ValPtr Lambda::persisted() const {
+    return bundle(new Lambda(this->arg_id, this->arg_name, persist(this->body)));
   }
 
-  Apply::Apply(const ValPtr& pred, const ValPtr& arg) : pred(pred), arg(arg) {}
+  Apply::Apply(const ValPtr& pred, const ValPtr& arg) : Value(KIND, hashMix(hashMix(APPLY_SEED, pred->hash()), arg->hash()), mergeRefIds(pred->freeRefs, arg->freeRefs)), pred(pred), arg(arg) {}
   void Apply::repr(std::ostream& o) const {
-    if (const Apply *s = dynamic_cast<const Apply *>(this->pred.get())) {
+    if (this->pred->kind == Kind::APPLY) {
       this->pred->repr(o);
       o << ' ';
       this->arg->repr_closed(o);
@@ -499,19 +2220,8 @@ namespace logic {
     o << ')';
   }
   ValSet Apply::subst(Scope& s) {
-    if (!this->savedRefIds) {
-      this->savedRefIds = std::shared_ptr<std::unordered_set<SymId>>(new std::unordered_set<SymId>());
-      this->collectRefIds(*this->savedRefIds);
-    }
-    bool disjoint = true;
-    for (const SymId& refId : *this->savedRefIds) {
-      if (s.has(refId)) {
-        disjoint = false;
-        break;
-      }
-    }
-    if (disjoint) {
-      return ValSet({this->self.lock()}, 1);
+    if (!this->refsBoundIn(s)) {
+      return ValSet({this->self()}, 1);
     }
     ValSet predVals = this->pred->subst(s);
     ValSet argVals = this->arg->subst(s);
@@ -523,50 +2233,164 @@ namespace logic {
     }
     return res;
   }
-  ValSet Apply::eval(Scope& s, World& w) {
-    ValSet predVals = this->pred->eval(s, w);
-    ValSet argVals = this->arg->eval(s, w);
-    ValSet res(predVals.bucket_count()*argVals.bucket_count());
-    for (const ValPtr& predVal : predVals) {
-      if (const Lambda *l = dynamic_cast<const Lambda *>(predVal.get())) {
-        Scope s2 = Scope(&s);
-        s2.add(l->arg_id, argVals);
-        for (const ValPtr& resVal : l->body->eval(s2, w)) {
-          res.insert(resVal);
+  // Forking is only sound outside proof search, where a task's fresh
+  // search state has no loop-detection history to lose
+  bool canFork(const World& w) {
+    return WorkPool::instance() && w.atTopLevel();
+  }
+  ValSet forkEval(const std::vector<std::pair<ValPtr, Scope>>& jobs, World& w) {
+    w.freezeLayers();
+    std::vector<std::unique_ptr<Arena>> arenas;
+    std::vector<ValSet> results(jobs.size());
+    std::vector<std::function<void()>> tasks;
+    // A job may be stolen by a thread working under another search's token
+    const CancelToken *token = cancelToken;
+    for (std::size_t i = 0; i < jobs.size(); ++i) {
+      arenas.push_back(std::unique_ptr<Arena>(new Arena(&Arena::current())));
+      tasks.push_back([&jobs, &arenas, &results, &w, token, i]() {
+        UseArena use(*arenas[i]);
+        UseCancelToken useToken(token);
+        World::Task task;
+        Scope s(jobs[i].second);
+        results[i] = jobs[i].first->eval(s, w);
+      });
+    }
+    WorkPool::instance()->run(tasks);
+    ValSet res;
+    for (std::size_t i = 0; i < jobs.size(); ++i) {
+      for (const ValPtr& val : results[i]) {
+        res.insert(adopt(val, *arenas[i]));
+      }
+    }
+    return res;
+  }
+
+  class ApplyStream: public ValStream {
+  private:
+    Scope s;
+    World& w;
+    ValStreamPtr preds;
+    std::shared_ptr<const ValSet> argVals;
+    ValPtr predVal;
+    ValSet::const_iterator argIt;
+    ValStreamPtr body;
+  public:
+    ApplyStream(const Apply *a, Scope& s, World& w) : s(s), w(w) {
+      this->preds = ValStreamPtr(new UniqueStream(a->pred->stream(s, w)));
+      this->argVals = std::make_shared<const ValSet>(a->arg->eval(s, w));
+      if (canFork(w)) {
+        ValSet predVals = collect(std::move(this->preds));
+        std::vector<std::pair<ValPtr, Scope>> jobs;
+        for (const ValPtr& predVal : predVals) {
+          if (const Lambda *l = valCast<Lambda>(predVal.get())) {
+            Scope s2(s);
+            s2.add(l->arg_id, this->argVals);
+            jobs.push_back(std::pair<ValPtr, Scope>(l->body, s2));
+          }
         }
-      } else {
-        for (const ValPtr& argVal : argVals) {
-          res.insert(bundle(new Apply(predVal, argVal)));
+        if (jobs.size() > 1) {
+          for (auto it = predVals.begin(); it != predVals.end();) {
+            it = (*it)->kind == Kind::LAMBDA ? predVals.erase(it) : std::next(it);
+          }
+          this->body = ValStreamPtr(new SetStream(forkEval(jobs, w)));
         }
+        this->preds = ValStreamPtr(new SetStream(std::move(predVals)));
       }
     }
-    return res;
+    bool next(ValPtr& out) override {
+      while (true) {
+        if (this->body) {
+          if (this->body->next(out)) {
+            return true;
+          }
+          this->body.reset();
+        } else if (this->predVal) {
+          if (this->argIt != this->argVals->end()) {
+            out = bundle(new Apply(this->predVal, *this->argIt));
+            ++this->argIt;
+            return true;
+          }
+          this->predVal = ValPtr();
+        }
+        ValPtr predVal;
+        if (!this->preds->next(predVal)) {
+          return false;
+        }
+        if (const Lambda *l = valCast<Lambda>(predVal.get())) {
+          Scope s2(this->s);
+          s2.add(l->arg_id, this->argVals);
+          this->body = l->body->stream(s2, this->w);
+        } else {
+          this->predVal = predVal;
+          this->argIt = this->argVals->begin();
+        }
+      }
+    }
+  };
+
+  class MemoStream: public ValStream {
+  private:
+    ValPtr term;
+    Scope s;
+    World& w;
+    std::size_t consultations;
+    std::size_t minted;
+    ValStreamPtr inner;
+    ValSet vals;
+  public:
+    MemoStream(const ValPtr& term, Scope& s, World& w) : term(term), s(s), w(w), consultations{worldConsultations}, minted{ArbitraryInstance::minted()} {
+      this->inner = ValStreamPtr(new ApplyStream(valCast<Apply>(term.get()), s, w));
+    }
+    bool next(ValPtr& out) override {
+      if (!this->inner) {
+        return false;
+      }
+      if (this->inner->next(out)) {
+        this->vals.insert(out);
+        return true;
+      }
+      this->inner.reset();
+      if (this->minted == ArbitraryInstance::minted()) {
+        this->w.cacheEval(this->term, this->s, this->vals, this->consultations == worldConsultations);
+      }
+      return false;
+    }
+  };
+
+  ValSet Apply::eval(Scope& s, World& w) {
+    return collect(this->stream(s, w));
+  }
+  ValStreamPtr Apply::stream(Scope& s, World& w) {
+    if (!this->closedIn(s)) {
+      return ValStreamPtr(new ApplyStream(this, s, w));
+    }
+    ValSet cached;
+    if (w.cachedEval(this->self(), s, cached)) {
+      return ValStreamPtr(new SetStream(std::move(cached)));
+    }
+    return ValStreamPtr(new MemoStream(this->self(), s, w));
   }
-  bool Apply::match(const ValPtr& other, Scope& s) const {
-    if (const Apply *a = dynamic_cast<const Apply *>(other.get())) {
-      return this->pred->match(a->pred, s) && this->arg->match(a->arg, s);
+  bool Apply::match(const ValPtr& other, Trail& t) const {
+    if (const Apply *a = valCast<Apply>(other.get())) {
+      return this->pred->match(a->pred, t) && this->arg->match(a->arg, t);
     }
     return false;
   }
   bool Apply::operator==(const Value& other) const {
-    if (const Apply *s = dynamic_cast<const Apply *>(&other)) {
-      return *this->pred == *s->pred && *this->arg == *s->arg;
+    if (const Apply *s = valCast<Apply>(&other)) {
+      return this->pred == s->pred && this->arg == s->arg;
     }
     return false;
   }
-  std::size_t Apply::hash() const {
-    return 9858124 ^ this->pred->hash() ^ this->arg->hash();
+  ValPtr Apply::persisted() const {
+    return bundle(new Apply(persist(this->pred), persist(this->arg)));
   }
   void Apply::flatten(std::vector<ValPtr>& v) const {
     this->pred->flatten(v);
     v.push_back(this->arg);
   }
-  void Apply::collectRefIds(std::unordered_set<SymId>& refIds) const {
-    this->pred->collectRefIds(refIds);
-    this->arg->collectRefIds(refIds);
-  }
 
-  Declare::Declare(const ValPtr& with, const ValPtr& body) : with(with), body(body) {}
+  Declare::Declare(const ValPtr& with, const ValPtr& body) : Value(KIND, hashMix(hashMix(DECLARE_SEED, with->hash()), body->hash()), mergeRefIds(with->freeRefs, body->freeRefs)), with(with), body(body) {}
   void Declare::repr(std::ostream& o) const {
     o << '{';
     this->with->repr(o);
@@ -579,19 +2403,8 @@ namespace logic {
     o << ')';
   }
   ValSet Declare::subst(Scope& s) {
-    if (!this->savedRefIds) {
-      this->savedRefIds = std::shared_ptr<std::unordered_set<SymId>>(new std::unordered_set<SymId>());
-      this->collectRefIds(*this->savedRefIds);
-    }
-    bool disjoint = true;
-    for (const SymId& refId : *this->savedRefIds) {
-      if (s.has(refId)) {
-        disjoint = false;
-        break;
-      }
-    }
-    if (disjoint) {
-      return ValSet({this->self.lock()}, 1);
+    if (!this->refsBoundIn(s)) {
+      return ValSet({this->self()}, 1);
     }
     ValSet withVals = this->with->subst(s);
     ValSet bodyVals = this->body->subst(s);
@@ -603,41 +2416,47 @@ namespace logic {
     }
     return res;
   }
-  ValSet Declare::eval(Scope& s, World& w) {
-    World w2(&w);
-    ValSet withVals = this->with->eval(s, w);
-    for (const ValPtr& withVal : withVals) {
-      w2.add(withVal);
-    }
-    const Declare *prev = this;
-    ValPtr curr = this->body;
-    while (const Declare *d = dynamic_cast<const Declare *>(curr.get())) {
-      withVals = d->with->eval(s, w);
-      for (const ValPtr& withVal : withVals) {
-        w2.add(withVal);
+  class DeclareStream: public ValStream {
+  private:
+    World w2;
+    ValStreamPtr body;
+  public:
+    DeclareStream(const Declare *decl, Scope& s, World& w) : w2(&w) {
+      const Declare *prev = decl;
+      ValPtr curr = decl->self();
+      while (const Declare *d = valCast<Declare>(curr.get())) {
+        for (const ValPtr& withVal : d->with->eval(s, w)) {
+          this->w2.add(withVal);
+        }
+        prev = d;
+        curr = d->body;
       }
-      prev = d;
-      curr = d->body;
+      this->body = prev->body->stream(s, this->w2);
+    }
+    bool next(ValPtr& out) override {
+      return this->body->next(out);
     }
-    return prev->body->eval(s, w2);
+  };
+
+  ValSet Declare::eval(Scope& s, World& w) {
+    return collect(this->stream(s, w));
+  }
+  ValStreamPtr Declare::stream(Scope& s, World& w) {
+    return ValStreamPtr(new DeclareStream(this, s, w));
   }
   bool Declare::operator==(const Value& other) const {
-    if (const Declare *s = dynamic_cast<const Declare *>(&other)) {
-      if (*this->with == *s->with && *this->body == *s->body) {
+    if (const Declare *s = valCast<Declare>(&other)) {
+      if (this->with == s->with && this->body == s->body) {
         return true;
       }
     }
     return false;
   }
-  std::size_t Declare::hash() const {
-    return 2958125 ^ this->with->hash() ^ this->body->hash();
-  }
-  void Declare::collectRefIds(std::unordered_set<SymId>& refIds) const {
-    this->with->collectRefIds(refIds);
-    this->body->collectRefIds(refIds);
+  ValPtr Declare::persisted() const {
+    return bundle(new Declare(persist(this->with), persist(this->body)));
   }
 
-  Constrain::Constrain(const ValPtr& constraint, const ValPtr& body) : constraint(constraint), body(body) {}
+  Constrain::Constrain(const ValPtr& constraint, const ValPtr& body) : Value(KIND, hashMix(hashMix(CONSTRAIN_SEED, constraint->hash()), body->hash()), mergeRefIds(constraint->freeRefs, body->freeRefs)), constraint(constraint), body(body) {}
   void Constrain::repr(std::ostream& o) const {
     o << '[';
     this->constraint->repr(o);
@@ -650,19 +2469,8 @@ namespace logic {
     o << ')';
   }
   ValSet Constrain::subst(Scope& s) {
-    if (!this->savedRefIds) {
-      this->savedRefIds = std::shared_ptr<std::unordered_set<SymId>>(new std::unordered_set<SymId>());
-      this->collectRefIds(*this->savedRefIds);
-    }
-    bool disjoint = true;
-    for (const SymId& refId : *this->savedRefIds) {
-      if (s.has(refId)) {
-        disjoint = false;
-        break;
-      }
-    }
-    if (disjoint) {
-      return ValSet({this->self.lock()}, 1);
+    if (!this->refsBoundIn(s)) {
+      return ValSet({this->self()}, 1);
     }
     ValSet constraintVals = this->constraint->subst(s);
     ValSet bodyVals = this->body->subst(s);
@@ -674,103 +2482,306 @@ namespace logic {
     }
     return res;
   }
-  ValSet Constrain::eval(Scope& s, World& w) {
-    std::unordered_set<SymId> refIds;
-    this->constraint->collectRefIds(refIds);
-    if (refIds.size() == 0) {
-      for (ValPtr constraintVal : this->constraint->eval(s, w)) {
-        if (w.get_matches(constraintVal).size() > 0) {
-          return this->body->eval(s, w);
+  bool plainTerm(const ValPtr& v) {
+    switch (v->kind) {
+    case Kind::SYM:
+    case Kind::REF:
+    case Kind::WILDCARD:
+    case Kind::ARBITRARY_INSTANCE:
+      return true;
+    case Kind::APPLY: {
+      const Apply *a = valCast<Apply>(v.get());
+      return plainTerm(a->pred) && plainTerm(a->arg);
+    }
+    default:
+      return false;
+    }
+  }
+  bool groundData(const ValPtr& v) {
+    switch (v->kind) {
+    case Kind::SYM:
+    case Kind::ARBITRARY_INSTANCE:
+      return true;
+    case Kind::APPLY: {
+      const Apply *a = valCast<Apply>(v.get());
+      return groundData(a->pred) && groundData(a->arg);
+    }
+    default:
+      return false;
+    }
+  }
+
+  class ConstrainStream: public ValStream {
+  private:
+    const Constrain *c;
+    World& w;
+    Scope s2;
+    bool ground;
+    bool fresh;
+    bool joined;
+    std::vector<std::pair<SymId, ValSet>> bindings;
+    std::vector<ValSet::const_iterator> binding_iters;
+    std::vector<ValPtr> constraintVals;
+    std::size_t constraintIdx;
+    MatchStreamPtr matches;
+    bool scopelessMatch;
+    ValStreamPtr body;
+    bool advance() {
+      if (this->bindings.empty()) {
+        return false;
+      }
+      std::size_t curr_idx = this->bindings.size() - 1;
+      ++this->binding_iters[curr_idx];
+      while (this->binding_iters[curr_idx] == this->bindings[curr_idx].second.end()) {
+        if (curr_idx == 0) {
+          return false;
         }
+        this->binding_iters[curr_idx] = this->bindings[curr_idx].second.begin();
+        --curr_idx;
+        ++this->binding_iters[curr_idx];
       }
-      return ValSet();
-    } else {
-      Scope s2 = Scope(&s);
-      ValSet res;
-      std::vector<std::pair<SymId, ValSet>> bindings;
-      std::vector<ValSet::iterator> binding_iters;
-      for (auto it = refIds.begin(); it != refIds.end(); ++it) {
-        if (s.has(*it)) {
-          bindings.push_back(std::pair<SymId, ValSet>(*it, s.get(*it)));
-          binding_iters.push_back(bindings[bindings.size() - 1].second.begin());
-          if (binding_iters[binding_iters.size() - 1] == bindings[bindings.size() - 1].second.end()) {
-            s2.data[*it] = ValSet();
-          } else {
-            s2.data[*it] = ValSet({*binding_iters[binding_iters.size() - 1]}, 1);
+      for (std::size_t i = curr_idx; i < this->bindings.size(); ++i) {
+        this->s2.add(this->bindings[i].first, ValSet({*this->binding_iters[i]}, 1));
+      }
+      return true;
+    }
+    // Look the constraint up once with its bound refs left open, then keep
+    // the matches whose bindings fall in those refs' value sets. Only valid
+    // when every match is a ground fact, so a constraint that any rule
+    // could match falls back to the odometer.
+    bool join() {
+      std::size_t combinations = 1;
+      for (const std::pair<SymId, ValSet>& binding : this->bindings) {
+        for (const ValPtr& val : binding.second) {
+          if (!groundData(val)) {
+            return false;
           }
         }
+        combinations = combinations > SIZE_MAX / binding.second.size() ? SIZE_MAX : combinations * binding.second.size();
       }
-      if (bindings.size() == 0) {
-        for (ValPtr constraintVal : this->constraint->eval(s2, w)) {
-          bool scopelessMatch(false);
-          for (std::pair<ValPtr, Scope>& match : w.get_matches(constraintVal)) {
-            if (match.second.data.size() > 0) {
-              Scope& s3 = match.second;
-              s3.base = &s2;
-              for (const ValPtr& bodyVal : this->body->eval(s3, w)) {
-                res.insert(bodyVal);
-              }
-            } else if (!scopelessMatch) {
-              scopelessMatch = true;
-              for (const ValPtr& bodyVal : this->body->eval(s2, w)) {
-                res.insert(bodyVal);
-              }
-            }
+      if (combinations < 2 || !plainTerm(this->c->constraint)) {
+        return false;
+      }
+      Scope open(this->s2);
+      for (const std::pair<SymId, ValSet>& binding : this->bindings) {
+        open.remove(binding.first);
+      }
+      ValSet vals = this->c->constraint->eval(open, this->w);
+      for (const ValPtr& val : vals) {
+        if (this->w.estimate(val).quantified > 0) {
+          return false;
+        }
+      }
+      this->constraintVals.assign(vals.begin(), vals.end());
+      return true;
+    }
+    ValStreamPtr streamBody(Scope& s) {
+      // A planned chain is already in order, so skip planning its tail
+      if (const Constrain *next = valCast<Constrain>(this->c->body.get())) {
+        return ValStreamPtr(new ConstrainStream(next, s, this->w));
+      }
+      return this->c->body->stream(s, this->w);
+    }
+    bool bodyScope(const std::pair<ValPtr, Scope>& match, Scope& out) {
+      if (this->joined) {
+        for (const std::pair<SymId, ValSet>& binding : this->bindings) {
+          const ValSet& bound = match.second.get(binding.first);
+          if (bound.size() != 1 || !binding.second.count(*bound.begin())) {
+            return false;
           }
         }
-        return res;
-      }
-      std::size_t last_idx = binding_iters.size() - 1;
-      std::size_t curr_idx;
-      while (binding_iters[0] != bindings[0].second.end()) {
-        for (ValPtr constraintVal : this->constraint->eval(s2, w)) {
-          bool scopelessMatch(false);
-          for (const std::pair<ValPtr, Scope>& match : w.get_matches(constraintVal)) {
-            if (match.second.data.size() > 0) {
-              Scope s3 = match.second;
-              s3.base = &s2;
-              for (const ValPtr& bodyVal : this->body->eval(s3, w)) {
-                res.insert(bodyVal);
-              }
-            } else if (!scopelessMatch) {
-              scopelessMatch = true;
-              for (const ValPtr& bodyVal : this->body->eval(s2, w)) {
-                res.insert(bodyVal);
-              }
-            }
+      } else if (match.second.size() == 0) {
+        if (this->scopelessMatch) {
+          return false;
+        }
+        this->scopelessMatch = true;
+      }
+      out = this->s2;
+      out.extend(match.second);
+      return true;
+    }
+    // Parallel evaluation fans the bodies of all of a lookup's matches out
+    // at once; otherwise matches are pulled one body at a time
+    void startMatches(MatchStreamPtr&& matches) {
+      this->scopelessMatch = false;
+      if (!canFork(this->w)) {
+        this->matches = std::move(matches);
+        return;
+      }
+      std::vector<std::pair<ValPtr, Scope>> all;
+      drain(*matches, all, World::NO_LIMIT);
+      if (all.size() < 2) {
+        this->matches = MatchStreamPtr(new MatchListStream(std::move(all)));
+        return;
+      }
+      std::vector<std::pair<ValPtr, Scope>> jobs;
+      Scope s3;
+      for (const std::pair<ValPtr, Scope>& match : all) {
+        if (this->bodyScope(match, s3)) {
+          jobs.push_back(std::pair<ValPtr, Scope>(this->c->body, s3));
+        }
+      }
+      this->body = ValStreamPtr(new SetStream(forkEval(jobs, this->w)));
+    }
+    void nextMatch() {
+      std::pair<ValPtr, Scope> match;
+      if (!this->matches->next(match)) {
+        this->matches.reset();
+        return;
+      }
+      Scope s3;
+      if (this->bodyScope(match, s3)) {
+        this->body = this->streamBody(s3);
+      }
+    }
+  public:
+    ConstrainStream(const Constrain *c, Scope& s, World& w) : c(c), w(w), s2(s), fresh(true), joined(false), constraintIdx(0), scopelessMatch(false) {
+      const RefIds& refIds = c->constraint->freeRefs;
+      this->ground = refIds.empty();
+      for (const SymId& refId : refIds) {
+        if (s.has(refId)) {
+          this->bindings.push_back(std::pair<SymId, ValSet>(refId, s.get(refId)));
+          if (this->bindings.back().second.empty()) {
+            this->fresh = false;
+          }
+        }
+      }
+      for (const std::pair<SymId, ValSet>& binding : this->bindings) {
+        this->binding_iters.push_back(binding.second.begin());
+        if (this->fresh) {
+          this->s2.add(binding.first, ValSet({*binding.second.begin()}, 1));
+        }
+      }
+      if (!this->fresh) {
+        this->bindings.clear();
+      } else if (!this->bindings.empty()) {
+        this->joined = this->join();
+      }
+    }
+    bool next(ValPtr& out) override {
+      while (true) {
+        if (this->body) {
+          if (this->body->next(out)) {
+            return true;
           }
+          this->body.reset();
         }
-        ++binding_iters[last_idx];
-        if (binding_iters[last_idx] == bindings[last_idx].second.end()) {
-          curr_idx = last_idx;
-          while (binding_iters[curr_idx] == bindings[curr_idx].second.end() && curr_idx > 0) {
-            binding_iters[curr_idx] = bindings[curr_idx].second.begin();
-            s2.data[bindings[curr_idx].first].clear();
-            s2.data[bindings[curr_idx].first].insert(*binding_iters[curr_idx]);
-            --curr_idx;
-            ++binding_iters[curr_idx];
+        if (this->matches) {
+          this->nextMatch();
+        } else if (this->constraintIdx < this->constraintVals.size()) {
+          ValPtr constraintVal = this->constraintVals[this->constraintIdx++];
+          if (this->ground) {
+            if (this->w.holds(constraintVal)) {
+              this->constraintVals.clear();
+              this->body = this->streamBody(this->s2);
+            }
+            continue;
           }
+          this->startMatches(this->w.stream_matches(constraintVal));
+        } else if (this->joined) {
+          return false;
+        } else if (this->fresh) {
+          this->fresh = false;
+          ValSet vals = this->c->constraint->eval(this->s2, this->w);
+          this->constraintVals.assign(vals.begin(), vals.end());
+          this->constraintIdx = 0;
+        } else if (this->advance()) {
+          this->fresh = true;
         } else {
-          s2.data[bindings[last_idx].first].clear();
-          s2.data[bindings[last_idx].first].insert(*binding_iters[last_idx]);
+          return false;
         }
       }
-      return res;
     }
+  };
+
+  ValSet Constrain::eval(Scope& s, World& w) {
+    return collect(this->stream(s, w));
+  }
+  ValStreamPtr Constrain::stream(Scope& s, World& w) {
+    if (this->body->kind != Kind::CONSTRAIN) {
+      return ValStreamPtr(new ConstrainStream(this, s, w));
+    }
+    std::vector<PlanStep> steps = this->plan(s, w);
+    bool reordered = false;
+    const Constrain *c = this;
+    for (const PlanStep& step : steps) {
+      reordered = reordered || step.constraint != c->constraint;
+      c = valCast<Constrain>(c->body.get());
+    }
+    if (!reordered) {
+      return ValStreamPtr(new ConstrainStream(this, s, w));
+    }
+    ValPtr chain = this->chainBody();
+    for (auto it = steps.rbegin(); it != steps.rend(); ++it) {
+      chain = bundle(new Constrain(it->constraint, chain));
+    }
+    return ValStreamPtr(new ConstrainStream(valCast<Constrain>(chain.get()), s, w));
+  }
+  ValPtr Constrain::chainBody() const {
+    ValPtr body = this->body;
+    while (const Constrain *c = valCast<Constrain>(body.get())) {
+      body = c->body;
+    }
+    return body;
+  }
+  const std::size_t Constrain::QUANTIFIED_COST;
+  const std::size_t Constrain::BOUND_REF_SELECTIVITY;
+  std::size_t planCost(const ValPtr& constraint, const Scope& s, const std::unordered_set<SymId>& bound, const World& w) {
+    ShapeStats stats = w.estimate(constraint);
+    std::size_t cost = stats.ground;
+    bool open = false;
+    for (const SymId& refId : constraint->freeRefs) {
+      if (bound.count(refId) || (s.has(refId) && !s.get(refId).count(Wildcard::INSTANCE))) {
+        cost /= Constrain::BOUND_REF_SELECTIVITY;
+      } else {
+        open = true;
+      }
+    }
+    if (!open || (cost == 0 && stats.ground > 0)) {
+      cost = std::min<std::size_t>(stats.ground, 1);
+    }
+    return cost + stats.quantified * Constrain::QUANTIFIED_COST;
+  }
+  std::vector<Constrain::PlanStep> Constrain::plan(const Scope& s, const World& w) const {
+    std::vector<ValPtr> pending;
+    bool plain = true;
+    for (const Constrain *c = this; c != nullptr; c = valCast<Constrain>(c->body.get())) {
+      pending.push_back(c->constraint);
+      plain = plain && plainTerm(c->constraint) && w.estimate(c->constraint).quantified == 0;
+    }
+    // Only lookups of plain facts commute. A rule match binds nothing in
+    // the goal and isLegal cuts proofs by step order, so a chain touching
+    // any rule keeps the written order.
+    std::unordered_set<SymId> bound;
+    std::vector<PlanStep> steps;
+    while (!pending.empty()) {
+      std::size_t best = 0;
+      std::size_t bestCost = SIZE_MAX;
+      for (std::size_t i = 0; i < pending.size(); ++i) {
+        std::size_t cost = planCost(pending[i], s, bound, w);
+        if (cost < bestCost) {
+          best = i;
+          bestCost = cost;
+        }
+        if (!plain) {
+          break;
+        }
+      }
+      steps.push_back(PlanStep{pending[best], bestCost});
+      bound.insert(pending[best]->freeRefs.begin(), pending[best]->freeRefs.end());
+      pending.erase(pending.begin() + best);
+    }
+    return steps;
   }
   bool Constrain::operator==(const Value& other) const {
-    if (const Constrain *s = dynamic_cast<const Constrain *>(&other)) {
-      if (*this->constraint == *s->constraint && *this->body == *s->body) {
+    if (const Constrain *s = valCast<Constrain>(&other)) {
+      if (this->constraint == s->constraint && this->body == s->body) {
         return true;
       }
     }
     return false;
   }
-  std::size_t Constrain::hash() const {
-    return 28148592 ^ this->constraint->hash() ^ this->body->hash();
-  }
-  void Constrain::collectRefIds(std::unordered_set<SymId>& refIds) const {
-    this->constraint->collectRefIds(refIds);
-    this->body->collectRefIds(refIds);
+  ValPtr Constrain::persisted() const {
+    return bundle(new Constrain(persist(this->constraint), persist(this->body)));
   }
 }
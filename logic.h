@@ -2,9 +2,17 @@
 #define __SPE_LOGIC_H
 
 #include <string>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <iostream>
 #include <functional>
+#include <list>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -13,7 +21,19 @@ namespace logic {
   
   class Value;
 
-  typedef std::shared_ptr<Value> ValPtr;
+  class ValPtr {
+  private:
+    Value *ptr;
+  public:
+    ValPtr() : ptr{nullptr} {}
+    explicit ValPtr(Value *ptr) : ptr{ptr} {}
+    Value *get() const {return this->ptr;}
+    Value *operator->() const {return this->ptr;}
+    Value& operator*() const {return *this->ptr;}
+    explicit operator bool() const {return this->ptr != nullptr;}
+    bool operator==(const ValPtr& other) const {return this->ptr == other.ptr;}
+    bool operator!=(const ValPtr& other) const {return this->ptr != other.ptr;}
+  };
 
   struct ValPtrEqual {
     bool operator()(const ValPtr& v1, const ValPtr& v2) const;
@@ -23,48 +43,245 @@ namespace logic {
     std::size_t operator()(ValPtr const& v) const;
   };
   
-  typedef std::weak_ptr<Value> ValPtrWeak;
-  
-  typedef std::string SymId;
+  typedef std::uint32_t SymId;
+
+  const SymId NULL_SYM = 0;
+
+  SymId internSym(const std::string& name);
+  const std::string& symName(const SymId& id);
+  SymId freshBinder();
+
   typedef std::unordered_set<ValPtr, ValPtrHash, ValPtrEqual> ValSet;
 
+  typedef std::vector<SymId> RefIds;
+
+  struct InternHash {
+    std::size_t operator()(const Value *v) const;
+  };
+
+  struct InternEqual {
+    bool operator()(const Value *v1, const Value *v2) const;
+  };
+
+  typedef std::unordered_set<Value *, InternHash, InternEqual> InternTable;
+
+  class Arena {
+  private:
+    static const std::size_t BLOCK_SIZE = 1 << 16;
+    static const std::size_t ALIGN = alignof(std::max_align_t);
+    static thread_local Arena *active;
+    std::vector<char *> blocks;
+    std::size_t used;
+    std::vector<Value *> values;
+    InternTable interned;
+    const Arena *outer;
+    friend class UseArena;
+    friend ValPtr bundle(Value *val);
+  public:
+    Arena();
+    // Values already interned in outer are reused rather than duplicated
+    explicit Arena(const Arena *outer);
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena();
+    void *allocate(std::size_t size);
+    void release(void *p, std::size_t size);
+    static Arena& global();
+    static Arena& current();
+  };
+
+  class UseArena {
+  private:
+    Arena *prev;
+  public:
+    UseArena(Arena& arena);
+    UseArena(const UseArena&) = delete;
+    UseArena& operator=(const UseArena&) = delete;
+    ~UseArena();
+  };
+
   class Scope {
+  private:
+    struct Node;
+    typedef std::shared_ptr<const Node> NodePtr;
+    typedef std::shared_ptr<const ValSet> ValSetPtr;
+    struct Entry {
+      SymId key;
+      ValSetPtr vals;
+      NodePtr child;
+    };
+    struct Node {
+      std::uint32_t bitmap;
+      std::vector<Entry> entries;
+    };
+    NodePtr root;
+    std::size_t count;
+    static NodePtr insert(const NodePtr& node, unsigned shift, const SymId& k, const ValSetPtr& vs, bool& added);
+    static NodePtr merge(const Entry& e1, const Entry& e2, unsigned shift);
+    static NodePtr remove(const NodePtr& node, unsigned shift, const SymId& k, bool& removed);
+    static void forEach(const NodePtr& node, const std::function<void(const Entry&)>& f);
   public:
-    Scope *base;
-    std::unordered_map<SymId, ValSet> data;
     Scope();
-    Scope(Scope *base);
-    void add(const SymId& k, ValSet& vs);
-    ValSet& get(const SymId& k);
-    virtual bool has(const SymId& k) const;
-    virtual void squash_(std::unordered_map<SymId, ValSet>& out);
-    Scope squash();
+    void add(const SymId& k, const ValSet& vs);
+    void add(const SymId& k, const std::shared_ptr<const ValSet>& vs);
+    void remove(const SymId& k);
+    void extend(const Scope& other);
+    const ValSet& get(const SymId& k) const;
+    bool has(const SymId& k) const;
+    std::size_t size() const;
+    void forEach(const std::function<void(const SymId&, const ValSet&)>& f) const;
+    std::size_t hash() const;
+    bool operator==(const Scope& other) const;
+  };
+
+  class Trail {
+  private:
+    std::vector<std::pair<SymId, ValPtr>> bindings;
+  public:
+    std::size_t mark() const {return this->bindings.size();}
+    void undo(std::size_t mark) {this->bindings.resize(mark);}
+    void bind(const SymId& k, const ValPtr& v) {this->bindings.push_back({k, v});}
+    ValPtr lookup(const SymId& k) const;
+    Scope toScope() const;
+  };
+
+  class ValStream {
+  public:
+    virtual bool next(ValPtr& out) = 0;
+    virtual ~ValStream() {}
+  };
+
+  typedef std::unique_ptr<ValStream> ValStreamPtr;
+
+  class SetStream: public ValStream {
+  private:
+    ValSet vals;
+    ValSet::const_iterator it;
+  public:
+    SetStream(ValSet&& vals);
+    bool next(ValPtr& out) override;
+  };
+
+  class UniqueStream: public ValStream {
+  private:
+    ValStreamPtr source;
+    ValSet seen;
+  public:
+    UniqueStream(ValStreamPtr&& source);
+    bool next(ValPtr& out) override;
   };
 
-  class Shadow : public Scope {
-  protected:
-    std::unordered_set<SymId> shadowed;
+  ValSet collect(ValStreamPtr&& vs);
+
+  // Proofs of a goal, produced one at a time as the index is walked
+  class MatchStream {
   public:
-    Shadow(Scope *base);
-    void shadow(const SymId& k);
-    bool has(const SymId& k) const override;
-    void squash_(std::unordered_map<SymId, ValSet>& out) override;
+    virtual bool next(std::pair<ValPtr, Scope>& out) = 0;
+    virtual ~MatchStream() {}
   };
 
+  typedef std::unique_ptr<MatchStream> MatchStreamPtr;
+
   class World;
 
+  struct Shape {
+    ValPtr head;
+    std::size_t arity;
+    Shape() : arity{0} {}
+    Shape(const ValPtr& head, std::size_t arity) : head{head}, arity{arity} {}
+    static Shape of(const ValPtr& v);
+    bool operator==(const Shape& other) const {return this->head == other.head && this->arity == other.arity;}
+  };
+
+  struct ShapeHash {
+    std::size_t operator()(const Shape& s) const;
+  };
+
+  struct ShapeStats {
+    std::size_t ground;
+    std::size_t quantified;
+    ShapeStats() : ground{0}, quantified{0} {}
+  };
+
+  // One goal of a batched search, with its own answers
+  struct BatchGoal {
+    ValPtr val;
+    std::vector<ValPtr> flat;
+    std::vector<std::pair<ValPtr, Scope>> out;
+    std::size_t limit;
+  };
+
   class ValTable {
   private:
+    typedef std::vector<std::pair<ValPtr, std::shared_ptr<ValTable>>> QuantifiedBranches;
+    typedef std::vector<std::pair<ValPtr, ValPtr>> QuantifiedLeaves;
     std::unordered_map<ValPtr, std::shared_ptr<ValTable>, ValPtrHash, ValPtrEqual> branches;
     std::unordered_map<ValPtr, ValPtr, ValPtrHash, ValPtrEqual> leaves;
-    std::vector<std::pair<ValPtr, std::shared_ptr<ValTable>>> quantified_branches;
-    std::vector<std::pair<ValPtr, ValPtr>> quantified_leaves;
-    void add_(std::vector<ValPtr>::iterator it, std::vector<ValPtr>::iterator end, const ValPtr& p);
+    std::unordered_map<Shape, QuantifiedBranches, ShapeHash> quantified_branches;
+    std::unordered_map<Shape, QuantifiedLeaves, ShapeHash> quantified_leaves;
+    std::unordered_map<Shape, std::vector<std::pair<const ValTable *, ValPtr>>, ShapeHash> leaf_index;
+    std::unordered_map<Shape, QuantifiedLeaves, ShapeHash> quantified_leaf_index;
+    std::unordered_map<Shape, ShapeStats, ShapeHash> stats;
+    struct Frozen;
+    class PathWalk;
+    class WholeValWalk;
+    std::unique_ptr<Frozen> frozen;
+    // Adds made since the last freeze, searched after the frozen layout
+    // until there are enough of them to be worth refreezing
+    static const std::size_t RECENT_LIMIT = 1024;
+    std::unique_ptr<ValTable> recent;
+    std::size_t recentAdds;
+    typedef std::vector<std::pair<std::vector<ValPtr>, ValPtr>> Paths;
+    // root keeps the whole-value index and stats for p; the overlay has none,
+    // since lookups read those from the table it belongs to
+    void add_(std::vector<ValPtr>::iterator it, std::vector<ValPtr>::iterator end, const ValPtr& p, ValTable *root);
+    void addPaths_(Paths::iterator begin, Paths::iterator end, std::size_t depth, ValTable& root);
+    std::uint32_t freeze_(Frozen& f) const;
+    const ValPtr *findLeaf_(const std::vector<ValPtr>& path) const;
+    bool hasFirst_(const ValPtr& first) const;
+    void get_matches_batch_(std::uint32_t n, std::size_t depth, std::vector<BatchGoal *>& goals, World& w) const;
   public:
     ValTable();
-    void add(const ValPtr& p);
-    void get_matches_whole_val(const ValPtr& val, Scope a, Scope b, World& w, std::vector<std::pair<ValPtr, Scope>>& out);
-    void get_matches(const ValPtr& val, std::vector<ValPtr>::iterator it, std::vector<ValPtr>::iterator end, Scope a, Scope b, World& w, std::vector<std::pair<ValPtr, Scope>>& out);
+    ~ValTable();
+    // Returns whether p gave the table a new first key
+    bool add(const ValPtr& p);
+    void addAll(const std::vector<ValPtr>& ps);
+    bool empty() const;
+    bool mayMatchShape(const Shape& shape) const;
+    void freeze();
+    ShapeStats statsFor(const Shape& shape) const;
+    // The limit is how many matches the caller may take at most; it only
+    // bounds the work done ahead of them, such as OR-parallel proofs
+    MatchStreamPtr stream_matches_whole_val(const ValPtr& val, World& w, std::size_t limit);
+    MatchStreamPtr stream_matches(const ValPtr& val, const std::vector<ValPtr>& path, World& w, std::size_t limit);
+    void get_matches_batch(std::vector<BatchGoal *>& goals, World& w);
+  };
+
+  class WorkPool {
+  private:
+    struct Queue {
+      std::mutex lock;
+      std::deque<std::function<void()>> jobs;
+    };
+    static std::unique_ptr<WorkPool> pool;
+    static thread_local std::size_t slot;
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<std::size_t> queued;
+    bool stopping;
+    std::mutex sleepLock;
+    std::condition_variable wake;
+    bool runOne();
+    void work(std::size_t index);
+  public:
+    WorkPool(std::size_t size);
+    WorkPool(const WorkPool&) = delete;
+    WorkPool& operator=(const WorkPool&) = delete;
+    ~WorkPool();
+    std::size_t size() const;
+    void run(std::vector<std::function<void()>>& jobs);
+    static void configure(std::size_t size);
+    static WorkPool *instance();
   };
 
   class CheckStep {
@@ -77,117 +294,284 @@ namespace logic {
 
   class World {
   private:
+    struct TableEntry {
+      std::vector<std::pair<ValPtr, Scope>> answers;
+      std::unordered_multimap<std::size_t, std::size_t> answerIndex;
+      std::size_t depth;
+      std::size_t lowLink;
+      bool evaluating;
+      bool complete;
+      bool consumed;
+      std::vector<ValPtr> members;
+      TableEntry() : depth{0}, lowLink{0}, evaluating{false}, complete{false}, consumed{false} {}
+    };
+    struct EvalEntry {
+      ValPtr term;
+      std::vector<ValSet> bindings;
+      ValSet vals;
+      std::size_t hash;
+      std::size_t version;
+      bool pure;
+      bool persisted;
+    };
+    struct SearchState {
+      std::vector<CheckStep> stepsTaken;
+      std::vector<std::uint64_t> stepHashes;
+      std::vector<std::uint64_t> stepPowers;
+      std::unordered_map<const Value *, std::vector<std::size_t>> stepPositions;
+      std::size_t layersVersion;
+      std::vector<World *> layers;
+      std::unordered_map<Shape, std::vector<World *>, ShapeHash> layersByShape;
+      std::size_t tablesVersion;
+      std::size_t answerCount;
+      std::unordered_map<ValPtr, TableEntry, ValPtrHash, ValPtrEqual> tables;
+      std::vector<ValPtr> tableStack;
+      std::list<EvalEntry> evalCache;
+      std::unordered_multimap<std::size_t, std::list<EvalEntry>::iterator> evalIndex;
+      SearchState();
+    };
+    static thread_local std::unordered_map<const World *, SearchState> *taskStates;
     ValTable data;
     World *base;
     std::size_t numPrevSteps;
-    std::vector<CheckStep> stepsTaken;
+    bool tabling;
+    bool orParallel;
+    std::size_t version;
+    // Bumped only when a layer gains a first key, since that is all
+    // relevantLayers depends on
+    std::size_t keysVersion;
+    mutable SearchState mainState;
+    std::atomic<std::size_t> evalHits;
+    std::atomic<std::size_t> evalMisses;
+    std::atomic<std::size_t> evalEvictions;
+    SearchState& state() const;
+    const std::vector<World *>& relevantLayers(const ValPtr& first);
     std::size_t getNumStepsTaken() const;
-    bool hasRepeatedStepSeq(std::vector<CheckStep>& seen, std::vector<CheckStep>& currMatch, std::size_t cutoff) const;
+    std::uint64_t stepRangeHash(std::size_t begin, std::size_t end) const;
+    bool hasRepeatedStepSeq(const CheckStep& next) const;
+    std::size_t chainVersion() const;
+    std::size_t chainKeysVersion() const;
+    // One pass of a search: the layers to look in, and the path to look
+    // up in each, or none to match the goal against whole leaves
+    struct Lookup {
+      std::vector<World *> layers;
+      std::vector<ValPtr> path;
+    };
+    std::vector<Lookup> lookups(ValPtr &p);
+    MatchStreamPtr streamLayer(const ValPtr& p, const std::vector<ValPtr>& path, std::size_t limit);
+    std::vector<std::pair<ValPtr, Scope>> search(ValPtr &p, std::size_t limit);
+    std::vector<std::pair<ValPtr, Scope>> tabled(ValPtr &p, std::size_t limit);
+    void searchLayers(ValPtr &p, const Lookup& lookup, std::vector<std::pair<ValPtr, Scope>>& res, std::size_t limit);
   public:
+    class Task;
+    // A copy of the step stacks along a world's chain, taken on this thread
+    class Steps {
+    private:
+      std::unordered_map<const World *, SearchState> states;
+      friend class Task;
+    public:
+      Steps(const World& w);
+    };
+    // While alive, searches on this thread use per-task state, either
+    // fresh or starting from a copy of the given step stacks
+    class Task {
+    private:
+      std::unordered_map<const World *, SearchState> states;
+      std::unordered_map<const World *, SearchState> *prev;
+    public:
+      Task();
+      Task(const Steps& steps);
+      Task(const Task&) = delete;
+      Task& operator=(const Task&) = delete;
+      ~Task();
+    };
+    // Everything one thread needs to query a world: its own search state
+    // and an arena for the values it builds. Once freezeLayers() has run,
+    // a world's index is only read, so any number of threads can query it
+    // at once, each through its own Query. Answers live until it ends.
+    class Query {
+    private:
+      Arena arena;
+      UseArena use;
+      Task task;
+    public:
+      Query();
+      // For a thread other than the one that built the values it queries
+      // with, which passes the arena they live in
+      explicit Query(const Arena& outer);
+    };
+    struct EvalCacheStats {
+      std::size_t hits;
+      std::size_t misses;
+      std::size_t evictions;
+    };
     World();
     World(World *base);
+    World(const World&) = delete;
+    World& operator=(const World&) = delete;
+    ~World();
     void add(const ValPtr& p);
-    std::vector<std::pair<ValPtr, Scope>> get_matches(ValPtr &p);
+    void addAll(const std::vector<ValPtr>& ps);
+    static const std::size_t NO_LIMIT = SIZE_MAX;
+    std::vector<std::pair<ValPtr, Scope>> get_matches(ValPtr &p, std::size_t limit = NO_LIMIT);
+    MatchStreamPtr stream_matches(ValPtr &p);
+    bool holds(ValPtr &p);
+    std::vector<std::vector<std::pair<ValPtr, Scope>>> get_matches_batch(std::vector<ValPtr>& goals, std::size_t limit = NO_LIMIT);
+    std::vector<bool> holdsBatch(std::vector<ValPtr>& goals);
+    bool atTopLevel() const;
+    void freezeLayers();
+    ShapeStats estimate(const ValPtr& p) const;
+    void setTabling(bool on);
+    bool isTabling() const;
+    void setOrParallel(bool on);
+    bool isOrParallel() const;
+    void clearCaches();
+    void persistCaches();
+    static const std::size_t EVAL_CACHE_CAPACITY = 4096;
+    bool cachedEval(const ValPtr& term, const Scope& s, ValSet& out);
+    void cacheEval(const ValPtr& term, const Scope& s, const ValSet& vals, bool pure);
+    EvalCacheStats evalCacheStats() const;
     bool isLegal(const CheckStep& next) const;
     void pushStep(const CheckStep& step);
     void popStep();
   };
   
+  enum class Kind : std::uint8_t {
+    SYM,
+    WILDCARD,
+    REF,
+    ARBITRARY,
+    ARBITRARY_INSTANCE,
+    LAMBDA,
+    APPLY,
+    DECLARE,
+    CONSTRAIN
+  };
+
   class Value {
   public:
-    ValPtrWeak self;
+    Arena *arena;
+    const Kind kind;
+    const std::size_t hashVal;
+    const RefIds freeRefs;
+    Value(Kind kind, std::size_t hashVal) : kind{kind}, hashVal{hashVal} {}
+    Value(Kind kind, std::size_t hashVal, RefIds&& freeRefs) : kind{kind}, hashVal{hashVal}, freeRefs(std::move(freeRefs)) {}
+    static void *operator new(std::size_t size);
+    static void operator delete(void *p, std::size_t size);
+    ValPtr self() const {return ValPtr(const_cast<Value *>(this));}
+    virtual ValPtr persisted() const = 0;
     virtual void repr(std::ostream&) const = 0;
     virtual void repr_closed(std::ostream& o) const {this->repr(o);}
     virtual std::string repr_str() const;
     virtual ValSet subst(Scope&) = 0;
     virtual ValSet eval(Scope& s, World& w) {return this->subst(s);}
-    virtual bool match(const ValPtr& other, Scope&) const {return *this == *other;}
+    virtual ValStreamPtr stream(Scope& s, World& w);
+    virtual bool match(const ValPtr& other, Trail&) const {return this == other.get();}
     virtual bool operator==(const Value&) const = 0;
-    virtual std::size_t hash() const = 0;
-    virtual void flatten(std::vector<ValPtr>& v) const {v.push_back(this->self.lock());}
-    virtual void collectRefIds(std::unordered_set<SymId>& s) const {}
+    std::size_t hash() const {return this->hashVal;}
+    virtual void flatten(std::vector<ValPtr>& v) const {v.push_back(this->self());}
+    bool hasRefs() const {return !this->freeRefs.empty();}
+    bool refsBoundIn(const Scope& s) const;
+    bool closedIn(const Scope& s) const;
+    virtual ~Value() {}
   };
 
+  template <typename T>
+  T *valCast(Value *val) {
+    return val->kind == T::KIND ? static_cast<T *>(val) : nullptr;
+  }
+
+  template <typename T>
+  const T *valCast(const Value *val) {
+    return val->kind == T::KIND ? static_cast<const T *>(val) : nullptr;
+  }
+
   ValPtr bundle(Value *val);
+  ValPtr persist(const ValPtr& p);
+  ValSet persist(const ValSet& vs);
 
   class Sym: public Value {
   private:
     const SymId sym_id;
   public:
+    static const Kind KIND = Kind::SYM;
     Sym(const SymId &sym_id);
     void repr(std::ostream& o) const override;
     ValSet subst(Scope& s) override;
     bool operator==(const Value& other) const override;
-    std::size_t hash() const override;
+    ValPtr persisted() const override;
   };
   
   class Wildcard: public Value {
   public:
+    static const Kind KIND = Kind::WILDCARD;
     static ValPtr INSTANCE;
     Wildcard();
     void repr(std::ostream& o) const override;
     ValSet subst(Scope& s) override;
     bool operator==(const Value& other) const override;
-    std::size_t hash() const override;
+    ValPtr persisted() const override;
   };
 
   class Ref : public Value {
-  private:
-    const SymId ref_id;
   public:
+    static const Kind KIND = Kind::REF;
+    const SymId ref_id;
+    const SymId name;
     Ref(const SymId& ref_id);
+    Ref(const SymId& ref_id, const SymId& name);
     void repr(std::ostream& o) const override;
     ValSet subst(Scope& s) override;
-    bool match(const ValPtr& other, Scope& s) const override;
+    bool match(const ValPtr& other, Trail& t) const override;
     bool operator==(const Value& other) const override;
-    std::size_t hash() const override;
-    void collectRefIds(std::unordered_set<SymId>& s) const override;
+    ValPtr persisted() const override;
   };
 
   class Arbitrary: public Value {
   public:
+    static const Kind KIND = Kind::ARBITRARY;
     static ValPtr INSTANCE;
     Arbitrary();
     void repr(std::ostream& o) const override;
     ValSet subst(Scope& s) override;
     ValSet eval(Scope& s, World& w) override;
     bool operator==(const Value& other) const override;
-    std::size_t hash() const override;
+    ValPtr persisted() const override;
   };
 
   class ArbitraryInstance: public Value {
   private:
-    static std::size_t count;
+    static std::atomic<std::size_t> count;
     std::size_t id;
+    ArbitraryInstance(std::size_t id);
   public:
+    static const Kind KIND = Kind::ARBITRARY_INSTANCE;
+    static std::size_t minted();
     ArbitraryInstance();
     void repr(std::ostream& o) const override;
     ValSet subst(Scope& s) override;
     bool operator==(const Value& other) const override;
-    std::size_t hash() const override;
+    ValPtr persisted() const override;
   };
 
   class Lambda: public Value {
-  private:
-    static std::size_t count;
-    std::size_t id;
-    std::shared_ptr<std::unordered_set<SymId>> savedRefIds;
   public:
+    static const Kind KIND = Kind::LAMBDA;
     const SymId arg_id;
+    const SymId arg_name;
     const ValPtr body;
-    Lambda(const SymId& arg_id, const ValPtr& body);
+    Lambda(const SymId& arg_id, const SymId& arg_name, const ValPtr& body);
     void repr(std::ostream& o) const override;
     void repr_closed(std::ostream& o) const override;
     ValSet subst(Scope& s) override;
     bool operator==(const Value& other) const override;
-    std::size_t hash() const override;
-    void collectRefIds(std::unordered_set<SymId>& s) const override;
+    ValPtr persisted() const override;
   };
 
   class Apply: public Value {
   private:
-    std::shared_ptr<std::unordered_set<SymId>> savedRefIds;
   public:
+    static const Kind KIND = Kind::APPLY;
     const ValPtr pred;
     const ValPtr arg;
     Apply(const ValPtr& pred, const ValPtr& arg);
@@ -195,17 +579,17 @@ namespace logic {
     void repr_closed(std::ostream& o) const override;
     ValSet subst(Scope& s) override;
     ValSet eval(Scope& s, World& w) override;
-    bool match(const ValPtr& other, Scope& s) const override;
+    ValStreamPtr stream(Scope& s, World& w) override;
+    bool match(const ValPtr& other, Trail& t) const override;
     bool operator==(const Value& other) const override;
-    std::size_t hash() const override;
+    ValPtr persisted() const override;
     void flatten(std::vector<ValPtr>& v) const override;
-    void collectRefIds(std::unordered_set<SymId>& s) const override;
   };
 
   class Declare: public Value {
   private:
-    std::shared_ptr<std::unordered_set<SymId>> savedRefIds;
   public:
+    static const Kind KIND = Kind::DECLARE;
     const ValPtr with;
     const ValPtr body;
     Declare(const ValPtr& with, const ValPtr& body);
@@ -213,25 +597,33 @@ namespace logic {
     void repr_closed(std::ostream& o) const override;
     ValSet subst(Scope& s) override;
     ValSet eval(Scope& s, World& w) override;
+    ValStreamPtr stream(Scope& s, World& w) override;
     bool operator==(const Value& other) const override;
-    std::size_t hash() const override;
-    void collectRefIds(std::unordered_set<SymId>& s) const override;
+    ValPtr persisted() const override;
   };
 
   class Constrain: public Value {
   private:
-    std::shared_ptr<std::unordered_set<SymId>> savedRefIds;
   public:
+    static const Kind KIND = Kind::CONSTRAIN;
+    static const std::size_t QUANTIFIED_COST = 8;
+    static const std::size_t BOUND_REF_SELECTIVITY = 10;
+    struct PlanStep {
+      ValPtr constraint;
+      std::size_t estimate;
+    };
     const ValPtr constraint;
     const ValPtr body;
     Constrain(const ValPtr& constraint, const ValPtr& body);
+    ValPtr chainBody() const;
+    std::vector<PlanStep> plan(const Scope& s, const World& w) const;
     void repr(std::ostream& o) const override;
     void repr_closed(std::ostream& o) const override;
     ValSet subst(Scope& s) override;
     ValSet eval(Scope& s, World& w) override;
+    ValStreamPtr stream(Scope& s, World& w) override;
     bool operator==(const Value& other) const override;
-    std::size_t hash() const override;
-    void collectRefIds(std::unordered_set<SymId>& s) const override;
+    ValPtr persisted() const override;
   };
 }
 
@@ -29,11 +29,14 @@ namespace parse {
   }
 
   logic::SymId parseSymId(std::istream& i) {
-    std::stringstream ss;
+    std::string name;
     while (isSymChar(i.peek())) {
-      ss << (char) i.get();
+      name.push_back((char) i.get());
     }
-    return ss.str();
+    if (name.empty()) {
+      return logic::NULL_SYM;
+    }
+    return logic::internSym(name);
   }
 
   void skipWhitespace(std::istream& i) {
@@ -52,13 +55,13 @@ namespace parse {
     }
   }
   
-  logic::ValPtr parse_not_apply(std::istream& i, logic::Scope& refIds) {
+  logic::ValPtr parse_not_apply(std::istream& i, logic::Scope& refIds, Binders& binders) {
     skipWhitespace(i);
     char c = i.peek();
     switch (c) {
     case '(': {
       i.get();
-      logic::ValPtr p = parse(i, refIds);
+      logic::ValPtr p = parse(i, refIds, binders);
       if (p && i.peek() == ')') {
         i.get();
         return p;
@@ -73,12 +76,12 @@ namespace parse {
       if (i.peek() == '>') {
         i.get();
         skipWhitespace(i);
-        logic::Scope refIds2 = logic::Scope(&refIds);
-        logic::ValSet empty;
-        refIds2.add(argId, empty);
-        logic::ValPtr body = parse(i, refIds2);
+        logic::SymId binder = logic::freshBinder();
+        binders.push_back(std::pair<logic::SymId, logic::SymId>(argId, binder));
+        logic::ValPtr body = parse(i, refIds, binders);
+        binders.pop_back();
         if (body) {
-          return logic::bundle(new logic::Lambda(argId, body));
+          return logic::bundle(new logic::Lambda(binder, argId, body));
         }
       }
     }
@@ -86,12 +89,12 @@ namespace parse {
     case '[': {
       i.get();
       skipWhitespace(i);
-      logic::ValPtr constraint = parse(i, refIds);
+      logic::ValPtr constraint = parse(i, refIds, binders);
       skipWhitespace(i);
       if (i.peek() == ']') {
         i.get();
         skipWhitespace(i);
-        if (logic::ValPtr body = parse(i, refIds)) {
+        if (logic::ValPtr body = parse(i, refIds, binders)) {
           return logic::bundle(new logic::Constrain(constraint, body));
         }
       }
@@ -100,12 +103,12 @@ namespace parse {
     case '{': {
       i.get();
       skipWhitespace(i);
-      logic::ValPtr with = parse(i, refIds);
+      logic::ValPtr with = parse(i, refIds, binders);
       skipWhitespace(i);
       if (i.peek() == '}') {
         i.get();
         skipWhitespace(i);
-        if (logic::ValPtr body = parse(i, refIds)) {
+        if (logic::ValPtr body = parse(i, refIds, binders)) {
           return logic::bundle(new logic::Declare(with, body));
         }
       }
@@ -119,9 +122,14 @@ namespace parse {
       return logic::Arbitrary::INSTANCE;
     default:
       logic::SymId symId = parseSymId(i);
-      if (symId.size() == 0) {
+      if (symId == logic::NULL_SYM) {
         break;
       }
+      for (Binders::reverse_iterator it = binders.rbegin(); it != binders.rend(); ++it) {
+        if (it->first == symId) {
+          return logic::bundle(new logic::Ref(it->second, symId));
+        }
+      }
       if (refIds.has(symId)) {
         return logic::bundle(new logic::Ref(symId));
       } else {
@@ -137,13 +145,18 @@ namespace parse {
   }
 
   logic::ValPtr parse(std::istream& i, logic::Scope& refIds) {
-    logic::ValPtr curr = parse_not_apply(i, refIds);
+    Binders binders;
+    return parse(i, refIds, binders);
+  }
+
+  logic::ValPtr parse(std::istream& i, logic::Scope& refIds, Binders& binders) {
+    logic::ValPtr curr = parse_not_apply(i, refIds, binders);
     if (!curr) {
       return curr;
     }
     while (true) {
       skipWhitespace(i);
-      logic::ValPtr next = parse_not_apply(i, refIds);
+      logic::ValPtr next = parse_not_apply(i, refIds, binders);
       if (next) {
         curr = logic::bundle(new logic::Apply(curr, next));
       } else {
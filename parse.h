@@ -5,10 +5,13 @@
 
 namespace parse {
 
+  typedef std::vector<std::pair<logic::SymId, logic::SymId>> Binders;
+
   void skipWhitespace(std::istream& i);
 
   logic::SymId parseSymId(std::istream& i);
   
+  logic::ValPtr parse(std::istream& i, logic::Scope& refIds, Binders& binders);
   logic::ValPtr parse(std::istream& i, logic::Scope& refIds);
   logic::ValPtr parse(std::istream& i);
 
@@ -1,11 +1,93 @@
 #include "logic.h"
 #include "parse.h"
 #include <sstream>
+#include <fstream>
 #include <iostream>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
 #include <readline/readline.h>
 #include <readline/history.h>
 
+const std::size_t LOAD_CHUNK_LINES = 4096;
+
+bool isData(const logic::ValPtr& v) {
+  switch (v->kind) {
+  case logic::Kind::SYM:
+  case logic::Kind::WILDCARD:
+    return true;
+  case logic::Kind::APPLY: {
+    const logic::Apply *a = logic::valCast<logic::Apply>(v.get());
+    return isData(a->pred) && isData(a->arg);
+  }
+  default:
+    return false;
+  }
+}
+
+bool explain(const logic::ValPtr& v, logic::Scope& s, logic::World& w) {
+  switch (v->kind) {
+  case logic::Kind::CONSTRAIN: {
+    const logic::Constrain *c = logic::valCast<logic::Constrain>(v.get());
+    std::cout << "# Plan:";
+    for (const logic::Constrain::PlanStep& step : c->plan(s, w)) {
+      std::cout << " [";
+      step.constraint->repr(std::cout);
+      std::cout << "] ~" << step.estimate;
+    }
+    std::cout << std::endl;
+    explain(c->chainBody(), s, w);
+    return true;
+  }
+  case logic::Kind::LAMBDA:
+    return explain(logic::valCast<logic::Lambda>(v.get())->body, s, w);
+  case logic::Kind::DECLARE:
+    return explain(logic::valCast<logic::Declare>(v.get())->body, s, w);
+  case logic::Kind::APPLY: {
+    const logic::Apply *a = logic::valCast<logic::Apply>(v.get());
+    bool found = explain(a->pred, s, w);
+    return explain(a->arg, s, w) || found;
+  }
+  default:
+    return false;
+  }
+}
+
+// Splits the goals between the pool's threads, each checking its share
+// through its own query of the frozen world
+std::vector<bool> holdsParallel(std::vector<logic::ValPtr>& goals, logic::World& w, logic::WorkPool& pool) {
+  w.freezeLayers();
+  std::size_t slices = std::min(pool.size(), goals.size());
+  std::vector<std::vector<bool>> found(slices);
+  const logic::Arena& outer = logic::Arena::current();
+  std::vector<std::function<void()>> jobs;
+  for (std::size_t i = 0; i < slices; ++i) {
+    jobs.push_back([&goals, &w, &found, &outer, slices, i]() {
+      logic::World::Query query(outer);
+      std::vector<logic::ValPtr> slice(goals.begin() + goals.size() * i / slices, goals.begin() + goals.size() * (i + 1) / slices);
+      found[i] = w.holdsBatch(slice);
+    });
+  }
+  pool.run(jobs);
+  std::vector<bool> res;
+  for (const std::vector<bool>& part : found) {
+    res.insert(res.end(), part.begin(), part.end());
+  }
+  return res;
+}
+
+// Keeps the eval cache's entries once the line's arena goes away
+class PersistCaches {
+private:
+  logic::World& w;
+public:
+  PersistCaches(logic::World& w) : w(w) {}
+  ~PersistCaches() {
+    this->w.persistCaches();
+  }
+};
+
 int main(int argc, char** argv) {
   std::string lineStr;
   logic::Scope s;
@@ -19,18 +101,24 @@ int main(int argc, char** argv) {
     if (lineStr == ":q") {
       return 0;
     } else {
+      logic::Arena queryArena;
+      logic::UseArena useQueryArena(queryArena);
+      PersistCaches persistCaches(w);
+      w.clearCaches();
       std::stringstream lineStream(lineStr);
       if (lineStr.substr(0, 4) == ":def") {
         lineStream.ignore(4);
         parse::skipWhitespace(lineStream);
         logic::SymId name = parse::parseSymId(lineStream);
-        if (name.size() > 0) {
-          logic::Shadow sh = logic::Shadow(&s);
-          sh.shadow(name);
+        if (name != logic::NULL_SYM) {
+          logic::Scope sh(s);
+          sh.remove(name);
           logic::ValPtr expr = parse::parse(lineStream, sh);
           if (expr) {
             logic::ValSet evald = expr->eval(sh, w);
-            s.add(name, evald);
+            logic::UseArena useGlobalArena(logic::Arena::global());
+            logic::ValSet persisted = logic::persist(evald);
+            s.add(name, persisted);
             add_history(lineCstr);
             continue;
           }
@@ -40,20 +128,167 @@ int main(int argc, char** argv) {
         logic::ValPtr expr = parse::parse(lineStream, s);
         if (expr) {
           logic::ValSet evald = expr->eval(s, w);
+          logic::UseArena useGlobalArena(logic::Arena::global());
           for (logic::ValPtr val : evald) {
-            w.add(val);
+            w.add(logic::persist(val));
+          }
+          add_history(lineCstr);
+          continue;
+        }
+      } else if (lineStr.substr(0, 5) == ":load") {
+        lineStream.ignore(5);
+        parse::skipWhitespace(lineStream);
+        std::string path;
+        std::getline(lineStream, path);
+        std::ifstream file(path);
+        if (file) {
+          std::vector<logic::ValPtr> facts;
+          std::size_t loaded(0);
+          std::string factStr;
+          std::stringstream factStream;
+          std::size_t lineNum(0);
+          while (file) {
+            logic::Arena chunkArena;
+            logic::UseArena useChunkArena(chunkArena);
+            w.clearCaches();
+            for (std::size_t chunkLines = 0; chunkLines < LOAD_CHUNK_LINES && std::getline(file, factStr); ++chunkLines) {
+              ++lineNum;
+              factStream.clear();
+              factStream.str(factStr);
+              parse::skipWhitespace(factStream);
+              if (factStream.peek() == EOF) {
+                continue;
+              }
+              logic::ValPtr expr = parse::parse(factStream, s);
+              if (!expr) {
+                std::cout << "Syntax error on line " << lineNum << std::endl;
+              } else if (isData(expr)) {
+                logic::UseArena useGlobalArena(logic::Arena::global());
+                facts.push_back(logic::persist(expr));
+              } else {
+                // Rules and expressions see everything loaded before them
+                if (!facts.empty()) {
+                  w.addAll(facts);
+                  loaded += facts.size();
+                  facts.clear();
+                }
+                logic::ValSet evald = expr->eval(s, w);
+                logic::UseArena useGlobalArena(logic::Arena::global());
+                for (logic::ValPtr val : evald) {
+                  w.add(logic::persist(val));
+                  ++loaded;
+                }
+              }
+            }
+            w.persistCaches();
+          }
+          w.addAll(facts);
+          loaded += facts.size();
+          std::cout << "# Loaded " << loaded << " facts" << std::endl;
+        } else {
+          std::cout << "# Could not open " << path << std::endl;
+        }
+        add_history(lineCstr);
+        continue;
+      } else if (lineStr.substr(0, 8) == ":tabling") {
+        lineStream.ignore(8);
+        std::string mode;
+        if (lineStream >> mode && (mode == "on" || mode == "off")) {
+          w.setTabling(mode == "on");
+          add_history(lineCstr);
+          continue;
+        }
+      } else if (lineStr.substr(0, 11) == ":orparallel") {
+        lineStream.ignore(11);
+        std::string mode;
+        if (lineStream >> mode && (mode == "on" || mode == "off")) {
+          w.setOrParallel(mode == "on");
+          add_history(lineCstr);
+          continue;
+        }
+      } else if (lineStr.substr(0, 8) == ":explain") {
+        lineStream.ignore(8);
+        logic::ValPtr expr = parse::parse(lineStream, s);
+        if (expr) {
+          if (!explain(expr, s, w)) {
+            std::cout << "# No constraints" << std::endl;
           }
           add_history(lineCstr);
           continue;
         }
+      } else if (lineStr.substr(0, 9) == ":parallel") {
+        lineStream.ignore(9);
+        long threads;
+        if (lineStream >> threads) {
+          long maxThreads = std::max(1u, std::thread::hardware_concurrency());
+          logic::WorkPool::configure(threads <= 1 ? 0 : std::min(threads, maxThreads));
+          add_history(lineCstr);
+          continue;
+        }
+      } else if (lineStr == ":stats") {
+        const logic::World::EvalCacheStats& stats = w.evalCacheStats();
+        std::cout << "# Eval cache: " << stats.hits << " hits, " << stats.misses << " misses, " << stats.evictions << " evictions" << std::endl;
+        add_history(lineCstr);
+        continue;
+      } else if (lineStr.substr(0, 9) == ":checkall") {
+        lineStream.ignore(9);
+        parse::skipWhitespace(lineStream);
+        std::string path;
+        std::getline(lineStream, path);
+        std::ifstream file(path);
+        if (file) {
+          std::vector<logic::ValPtr> goals;
+          std::vector<std::size_t> owners;
+          std::vector<std::string> lines;
+          std::vector<bool> parsed;
+          std::string goalStr;
+          std::stringstream goalStream;
+          while (std::getline(file, goalStr)) {
+            goalStream.clear();
+            goalStream.str(goalStr);
+            parse::skipWhitespace(goalStream);
+            if (goalStream.peek() == EOF) {
+              continue;
+            }
+            logic::ValPtr expr = parse::parse(goalStream, s);
+            if (expr) {
+              logic::UniqueStream evald(expr->stream(s, w));
+              logic::ValPtr val;
+              while (evald.next(val)) {
+                goals.push_back(val);
+                owners.push_back(lines.size());
+              }
+            }
+            lines.push_back(goalStr);
+            parsed.push_back(bool(expr));
+          }
+          std::vector<bool> holds(lines.size(), false);
+          logic::WorkPool *pool = logic::WorkPool::instance();
+          std::vector<bool> found = pool ? holdsParallel(goals, w, *pool) : w.holdsBatch(goals);
+          for (std::size_t i = 0; i < goals.size(); ++i) {
+            holds[owners[i]] = holds[owners[i]] || found[i];
+          }
+          for (std::size_t i = 0; i < lines.size(); ++i) {
+            if (!parsed[i]) {
+              std::cout << "Syntax error: " << lines[i] << std::endl;
+            } else {
+              std::cout << (holds[i] ? "# Holds" : "# Does not hold") << std::endl;
+            }
+          }
+        } else {
+          std::cout << "# Could not open " << path << std::endl;
+        }
+        add_history(lineCstr);
+        continue;
       } else if (lineStr.substr(0, 6) == ":check") {
         lineStream.ignore(6);
         logic::ValPtr expr = parse::parse(lineStream, s);
         if (expr) {
           bool holds(false);
-          logic::ValSet evald = expr->eval(s, w);
-          for (logic::ValPtr val : evald) {
-            if (w.get_matches(val).size() > 0) {
+          logic::UniqueStream evald(expr->stream(s, w));
+          logic::ValPtr val;
+          while (evald.next(val)) {
+            if (w.holds(val)) {
               holds = true;
               break;
             }
@@ -62,16 +297,41 @@ int main(int argc, char** argv) {
           add_history(lineCstr);
           continue;
         }
+      } else if (lineStr.substr(0, 6) == ":first") {
+        lineStream.ignore(6);
+        std::size_t limit;
+        if (lineStream >> limit) {
+          logic::ValPtr expr = parse::parse(lineStream, s);
+          if (expr) {
+            logic::UniqueStream evald(expr->stream(s, w));
+            logic::ValPtr val;
+            std::size_t count(0);
+            while (count < limit && evald.next(val)) {
+              ++count;
+              val->repr(std::cout);
+              std::cout << std::endl;
+            }
+            if (count == 0) {
+              std::cout << "# No result" << std::endl;
+            }
+            add_history(lineCstr);
+            continue;
+          }
+        }
       } else {
         logic::ValPtr expr = parse::parse(lineStream, s);
         if (expr) {
-          logic::ValSet evald = expr->eval(s, w);
-          if (evald.size() == 0) {
-            std::cout << "# No result" << std::endl;
-          } else for (logic::ValPtr val : evald) {
+          logic::UniqueStream evald(expr->stream(s, w));
+          logic::ValPtr val;
+          bool any(false);
+          while (evald.next(val)) {
+            any = true;
             val->repr(std::cout);
             std::cout << std::endl;
           }
+          if (!any) {
+            std::cout << "# No result" << std::endl;
+          }
           add_history(lineCstr);
           continue;
         }